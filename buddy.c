@@ -3,6 +3,10 @@
 #include <linux/module.h>
 #include <linux/slab.h>
 #include <linux/log2.h>
+#include <linux/sort.h>
+#include <linux/bitmap.h>
+#include <linux/vmalloc.h>
+#include <linux/numa.h>
 #include "buddy.h"
 //#include <lwk/bootmem.h>
 
@@ -10,26 +14,59 @@
 
 
 /**
- * Converts a block address to its block index in the specified buddy allocator.
- * A block's index is used to find the block's tag bit, mp->tag_bits[block_id].
+ * Returns the metadata chunk a block index falls in.
+ */
+static struct buddy_chunk *
+id_to_chunk(struct buddy_mempool *mp, unsigned long block_id)
+{
+	BUG_ON(block_id >= mp->num_blocks);
+	return &mp->chunks[block_id >> mp->chunk_shift];
+}
+
+
+/**
+ * Returns the metadata entry of a block. Its chunk must have been split once.
+ */
+static struct block *
+id_to_block(struct buddy_mempool *mp, unsigned long block_id)
+{
+	return &id_to_chunk(mp, block_id)->blocks[block_id & ((1UL << mp->chunk_shift) - 1)];
+}
+
+
+/**
+ * Converts an address to the index of the 2^min_order block starting there.
  */
 static unsigned long
-block_to_id(struct buddy_mempool *mp, struct block *block)
+addr_to_id(struct buddy_mempool *mp, const void *addr)
 {
-	unsigned long block_id =
-		((unsigned long)block - mp->base_addr) >> mp->min_order;
+	unsigned long block_id;
+
+	BUG_ON((unsigned long)addr < mp->base_addr);
+
+	block_id = ((unsigned long)addr - mp->base_addr) >> mp->min_order;
 	BUG_ON(block_id >= mp->num_blocks);
 	return block_id;
 }
 
 
+/**
+ * Returns the address of the memory a block describes.
+ */
+static void *
+id_to_addr(struct buddy_mempool *mp, unsigned long block_id)
+{
+	return (void *)(mp->base_addr + (block_id << mp->min_order));
+}
+
+
 /**
  * Marks a block as free by setting its tag bit to one.
  */
 static void
-mark_available(struct buddy_mempool *mp, struct block *block)
+mark_available(struct buddy_mempool *mp, unsigned long block_id)
 {
-	__set_bit(block_to_id(mp, block), mp->tag_bits);
+	__set_bit(block_id & ((1UL << mp->chunk_shift) - 1), id_to_chunk(mp, block_id)->tag_bits);
 }
 
 
@@ -37,41 +74,167 @@ mark_available(struct buddy_mempool *mp, struct block *block)
  * Marks a block as allocated by setting its tag bit to zero.
  */
 static void
-mark_allocated(struct buddy_mempool *mp, struct block *block)
+mark_allocated(struct buddy_mempool *mp, unsigned long block_id)
 {
-	__clear_bit(block_to_id(mp, block), mp->tag_bits);
+	__clear_bit(block_id & ((1UL << mp->chunk_shift) - 1), id_to_chunk(mp, block_id)->tag_bits);
 }
 
 
 /**
- * Returns true if block is free, false if it is allocated.
+ * Returns true if block is free, false if it is allocated. Whole free chunks
+ * are not covered, see top_add().
  */
 static int
-is_available(struct buddy_mempool *mp, struct block *block)
+is_available(struct buddy_mempool *mp, unsigned long block_id)
 {
-	return test_bit(block_to_id(mp, block), mp->tag_bits);
+	return test_bit(block_id & ((1UL << mp->chunk_shift) - 1), id_to_chunk(mp, block_id)->tag_bits);
 }
 
 
 /**
- * Returns the address of the block's buddy block.
+ * Counts a block in or out of the free blocks of its order, keeping
+ * avail_orders in sync.
  */
-static void *
-find_buddy(struct buddy_mempool *mp, struct block *block, unsigned long order)
+static void
+nr_free_inc(struct buddy_mempool *mp, unsigned long order)
+{
+	if (mp->nr_free[order]++ == 0) {
+		__set_bit(order, &mp->avail_orders);
+		if (mp->order_hook)
+			mp->order_hook(mp, order, 1);
+	}
+}
+
+static void
+nr_free_dec(struct buddy_mempool *mp, unsigned long order)
 {
-	unsigned long _block;
-	unsigned long _buddy;
+	if (--mp->nr_free[order] == 0) {
+		__clear_bit(order, &mp->avail_orders);
+		if (mp->order_hook)
+			mp->order_hook(mp, order, 0);
+	}
+}
 
-	BUG_ON((unsigned long)block < mp->base_addr);
 
-	/* Fixup block address to be zero-relative */
-	_block = (unsigned long)block - mp->base_addr;
+/**
+ * Adds a block to the free list of its order.
+ */
+static void
+avail_add(struct buddy_mempool *mp, unsigned long block_id, unsigned long order)
+{
+	struct block *block = id_to_block(mp, block_id);
+	u32 head = mp->avail[order];
+
+	block->next = head;
+	block->prev = BLOCK_NONE;
+	if (head != BLOCK_NONE)
+		id_to_block(mp, head)->prev = block_id;
+	mp->avail[order] = block_id;
+	nr_free_inc(mp, order);
+}
+
+
+/**
+ * Removes a block from the free list of its order.
+ */
+static void
+avail_del(struct buddy_mempool *mp, unsigned long block_id, unsigned long order)
+{
+	struct block *block = id_to_block(mp, block_id);
+
+	if (block->prev != BLOCK_NONE)
+		id_to_block(mp, block->prev)->next = block->next;
+	else
+		mp->avail[order] = block->next;
+	if (block->next != BLOCK_NONE)
+		id_to_block(mp, block->next)->prev = block->prev;
+	nr_free_dec(mp, order);
+}
+
+
+/**
+ * Free blocks of max_order are whole chunks. They are kept in the top_free
+ * bitmap instead of on a list, so a chunk that was never split needs no tag
+ * bits or block entries at all. top_hint is at or below the first set bit.
+ */
+static void
+top_add(struct buddy_mempool *mp, unsigned long chunk_id)
+{
+	__set_bit(chunk_id, mp->top_free);
+	if (chunk_id < mp->top_hint)
+		mp->top_hint = chunk_id;
+	nr_free_inc(mp, mp->max_order);
+}
+
+
+/**
+ * Gives a chunk its tag bits and block entries, the first time one of its
+ * blocks is handed out. They stay until the pool goes away. Runs under
+ * mp->lock, which callers may take in atomic context, so nothing here can
+ * sleep. Returns -1 if the memory is not there.
+ */
+static int
+chunk_init(struct buddy_mempool *mp, unsigned long chunk_id)
+{
+	struct buddy_chunk *chunk = &mp->chunks[chunk_id];
+	unsigned long *tag_bits;
+	struct block *blocks;
+
+	if (chunk->blocks)
+		return 0;
+
+	/* All zero: every block starts out allocated, as the chunk is about to be.
+	 * Block entries are written when their block is freed or allocated,
+	 * before anything reads them. */
+	tag_bits = kzalloc(BITS_TO_LONGS(1UL << mp->chunk_shift) * sizeof(long),
+			   GFP_ATOMIC | __GFP_NOWARN);
+	blocks = kmalloc((1UL << mp->chunk_shift) * sizeof(struct block),
+			 GFP_ATOMIC | __GFP_NOWARN);
+	if (!tag_bits || !blocks) {
+		kfree(tag_bits);
+		kfree(blocks);
+		return -1;
+	}
+
+	/* buddy_sparse_region() looks at chunks without the lock */
+	chunk->tag_bits = tag_bits;
+	smp_wmb();
+	WRITE_ONCE(chunk->blocks, blocks);
+	return 0;
+}
+
+
+/**
+ * Takes the first free block of order j off its list, or a whole chunk off
+ * top_free if j is max_order, and marks it allocated.
+ *
+ * Returns:
+ *       The block index, or BLOCK_NONE if the chunk had never been split
+ *       and its metadata could not be allocated.
+ */
+static unsigned long
+take_free(struct buddy_mempool *mp, unsigned long j)
+{
+	unsigned long block_id;
+	unsigned long chunk_id;
+
+	if (j < mp->max_order) {
+		block_id = mp->avail[j];
+		avail_del(mp, block_id, j);
+		mark_allocated(mp, block_id);
+		return block_id;
+	}
 
-	/* Calculate buddy in zero-relative space */
-	_buddy = _block ^ (1UL << order);
+	chunk_id = find_next_bit(mp->top_free, mp->nr_chunks, mp->top_hint);
+	BUG_ON(chunk_id >= mp->nr_chunks);
+	if (chunk_init(mp, chunk_id) != 0)
+		return BLOCK_NONE;
 
-	/* Return the buddy's address */
-	return (void *)(_buddy + mp->base_addr);
+	/* A whole free chunk never has its tag bit set */
+	__clear_bit(chunk_id, mp->top_free);
+	mp->top_hint = chunk_id + 1;
+	nr_free_dec(mp, mp->max_order);
+	return chunk_id << mp->chunk_shift;
 }
 
 
@@ -88,10 +251,15 @@ find_buddy(struct buddy_mempool *mp, struct block *block, unsigned long order)
  *       Failure: NULL
  *
  * NOTE: The min_order argument is provided as an optimization. Since one tag
- *       bit is required for each minimum-sized block, large memory pools that
- *       allow order 0 allocations will use large amounts of memory. Specifying
- *       a min_order of 5 (32 bytes), for example, reduces the number of tag
- *       bits by 32x.
+ *       bit and one struct block are required for each minimum-sized block,
+ *       large memory pools that allow order 0 allocations will use large
+ *       amounts of memory. Specifying a min_order of 5 (32 bytes), for
+ *       example, reduces the metadata by 32x.
+ *
+ *       That metadata is only allocated for a chunk of 2^BUDDY_CHUNK_SHIFT
+ *       minimum-sized blocks once the chunk is first split, so setting up a
+ *       pool costs a few bytes per chunk whatever its size. Chunks are also
+ *       the largest blocks the pool hands out.
  */
 struct buddy_mempool *
 buddy_init(
@@ -103,51 +271,92 @@ buddy_init(
 	struct buddy_mempool *mp;
 	unsigned long i;
 
-	/* Smallest block size must be big enough to hold a block structure */
-	if ((1UL << min_order) < sizeof(struct block))
-		min_order = ilog2( roundup_pow_of_two(sizeof(struct block)) );
-
 	/* The minimum block order must be smaller than the pool order */
 	if (min_order > pool_order)
 		return NULL;
 
-	mp = kmalloc(sizeof(struct buddy_mempool), GFP_KERNEL);
-	
+	/* Block indexes are 32 bits, with BLOCK_NONE left over to end the lists */
+	if (pool_order - min_order >= 32)
+		return NULL;
+
+	mp = kzalloc(sizeof(struct buddy_mempool), GFP_KERNEL);
+	if (mp == NULL)
+		return NULL;
+
 	mp->base_addr  = base_addr;
 	mp->pool_order = pool_order;
 	mp->min_order  = min_order;
+	spin_lock_init(&mp->lock);
+	mp->avail_orders = 0;
+	mp->pool_id      = -1;
+	mp->nid          = NUMA_NO_NODE;
+	mp->order_hook   = NULL;
+
+	mp->max_order   = min(pool_order, min_order + BUDDY_CHUNK_SHIFT);
+	mp->chunk_shift = mp->max_order - min_order;
+	mp->num_blocks  = 1UL << (pool_order - min_order);
+	mp->nr_chunks   = 1UL << (pool_order - mp->max_order);
+	mp->top_hint    = 0;
 
 	/* Allocate a list for every order up to the maximum allowed order */
-	mp->avail = kmalloc((pool_order + 1) * sizeof(struct list_head), GFP_KERNEL);
+	mp->avail = kmalloc((pool_order + 1) * sizeof(u32), GFP_KERNEL);
+	mp->nr_free = kzalloc((pool_order + 1) * sizeof(unsigned long), GFP_KERNEL);
 
-	/* Initially all lists are empty */
-	for (i = 0; i <= pool_order; i++)
-		INIT_LIST_HEAD(&mp->avail[i]);
+	/* No chunk has metadata yet and none is free, the pool starts out
+	 * fully allocated. Large pools need more than kmalloc can hand out
+	 * in one piece. */
+	mp->chunks   = vzalloc(mp->nr_chunks * sizeof(struct buddy_chunk));
+	mp->top_free = vzalloc(BITS_TO_LONGS(mp->nr_chunks) * sizeof(long));
 
-	/* Allocate a bitmap with 1 bit per minimum-sized block */
-	mp->num_blocks = (1UL << pool_order) / (1UL << min_order);
-	mp->tag_bits   = kmalloc(
-				 BITS_TO_LONGS(mp->num_blocks) * sizeof(long), GFP_KERNEL
-	                 );
-
-	printk("Allocating %lu bytes for tag array\n", BITS_TO_LONGS(mp->num_blocks) * sizeof(long));
+	if (!mp->avail || !mp->nr_free || !mp->chunks || !mp->top_free) {
+		buddy_deinit(mp);
+		return NULL;
+	}
 
-	/* Initially mark all minimum-sized blocks as allocated */
-	bitmap_zero(mp->tag_bits, mp->num_blocks);
+	/* Initially all lists are empty */
+	for (i = 0; i <= pool_order; i++)
+		mp->avail[i] = BLOCK_NONE;
 
 	return mp;
 }
 
 
 void buddy_deinit(struct buddy_mempool * mp) {
+    unsigned long i;
+
+    for (i = 0; mp->chunks && i < mp->nr_chunks; i++) {
+	kfree(mp->chunks[i].tag_bits);
+	kfree(mp->chunks[i].blocks);
+    }
+
     kfree(mp->avail);
-    kfree(mp->tag_bits);
+    kfree(mp->nr_free);
+    vfree(mp->chunks);
+    vfree(mp->top_free);
     kfree(mp);
 
     return;
 }
 
 
+/**
+ * Makes the whole pool available as free chunks. This is the only
+ * initialization the free lists need, one bit per chunk.
+ */
+void
+buddy_free_all(struct buddy_mempool *mp)
+{
+	spin_lock(&mp->lock);
+	bitmap_set(mp->top_free, 0, mp->nr_chunks);
+	mp->top_hint = 0;
+	/* Count them all in one go, the hook only needs to see the first */
+	mp->nr_free[mp->max_order] = 0;
+	nr_free_inc(mp, mp->max_order);
+	mp->nr_free[mp->max_order] = mp->nr_chunks;
+	spin_unlock(&mp->lock);
+}
+
+
 /**
  * Allocates a block of memory of the requested size (2^order bytes).
  *
@@ -162,41 +371,106 @@ void buddy_deinit(struct buddy_mempool * mp) {
 void *
 buddy_alloc(struct buddy_mempool *mp, unsigned long order)
 {
+	unsigned long i;
 	unsigned long j;
-	struct list_head *list;
+	unsigned long candidates;
+	unsigned long block_id;
+	unsigned long buddy_id;
 	struct block *block;
-	struct block *buddy_block;
 
 	BUG_ON(mp == NULL);
 	BUG_ON(order > mp->pool_order);
 
+	/* Blocks never grow past a chunk */
+	if (order > mp->max_order)
+		return NULL;
+
 	/* Fixup requested order to be at least the minimum supported */
 	if (order < mp->min_order)
 		order = mp->min_order;
 
-	for (j = order; j <= mp->pool_order; j++) {
+	spin_lock(&mp->lock);
 
-		/* Try to allocate the first block in the order j list */
-		list = &mp->avail[j];
-		if (list_empty(list))
-			continue;
-		block = list_entry(list->next, struct block, link);
-		list_del(&block->link);
-		mark_allocated(mp, block);
-
-		/* Trim if a higher order block than necessary was allocated */
-		while (j > order) {
-			--j;
-			buddy_block = (struct block *)((unsigned long)block + (1UL << j));
-			buddy_block->order = j;
-			mark_available(mp, buddy_block);
-			list_add(&buddy_block->link, &mp->avail[j]);
-		}
+	/* The smallest non-empty order that is big enough, found with one ffs */
+	candidates = mp->avail_orders & ~((1UL << order) - 1);
+	if (candidates == 0) {
+		spin_unlock(&mp->lock);
+		return NULL;
+	}
+	j = __ffs(candidates);
 
-		return block;
+	/* Allocate the first block in the order j list */
+	block_id = take_free(mp, j);
+	if (block_id == BLOCK_NONE) {
+		spin_unlock(&mp->lock);
+		return NULL;
 	}
 
-	return NULL;
+	/* Trim if a higher order block than necessary was allocated */
+	while (j > order) {
+		--j;
+		buddy_id = block_id + (1UL << (j - mp->min_order));
+		id_to_block(mp, buddy_id)->order = j;
+		mark_available(mp, buddy_id);
+		avail_add(mp, buddy_id, j);
+	}
+
+	/* Give every piece of the block a defined owner, a block never spans chunks */
+	block = id_to_block(mp, block_id);
+	for (i = 0; i < (1UL << (order - mp->min_order)); i++)
+		block[i].owner = NULL;
+
+	spin_unlock(&mp->lock);
+	return id_to_addr(mp, block_id);
+}
+
+
+/**
+ * Coalesces a block with its free buddies and puts it on a free list.
+ * Caller holds mp->lock and has already fixed up order.
+ */
+static void
+__buddy_free(struct buddy_mempool *mp, const void *addr, unsigned long order)
+{
+	unsigned long block_id;
+	unsigned long buddy_id;
+
+	/* Look up the metadata of the memory block being freed */
+	block_id = addr_to_id(mp, addr);
+	BUG_ON(test_bit(block_id >> mp->chunk_shift, mp->top_free));
+	BUG_ON(is_available(mp, block_id));
+
+	/* Coalesce as much as possible with adjacent free buddy blocks */
+	while (order < mp->max_order) {
+		/* Buddies differ in exactly one bit of their block index */
+		buddy_id = block_id ^ (1UL << (order - mp->min_order));
+
+		/* Make sure buddy is available and has the same size as us */
+		if (!is_available(mp, buddy_id))
+			break;
+		if (id_to_block(mp, buddy_id)->order != order)
+			break;
+
+		/* OK, we're good to go... buddy merge! */
+		avail_del(mp, buddy_id, order);
+		/* Only the head of a free block may carry a set tag bit,
+		 * bulk allocation relies on that when it splits blocks */
+		mark_allocated(mp, buddy_id);
+		if (buddy_id < block_id)
+			block_id = buddy_id;
+		++order;
+	}
+
+	/* A whole chunk again, its tag bits are all clear for the next split */
+	if (order == mp->max_order) {
+		top_add(mp, block_id >> mp->chunk_shift);
+		return;
+	}
+
+	/* Add the (possibly coalesced) block to the appropriate free list */
+	id_to_block(mp, block_id)->order = order;
+	mark_available(mp, block_id);
+	avail_add(mp, block_id, order);
 }
 
 
@@ -213,41 +487,350 @@ buddy_free(
 	unsigned long		order
 )
 {
-    struct block * block  = NULL;
+	BUG_ON(mp == NULL);
+	BUG_ON(order > mp->max_order);
+
+	/* Fixup requested order to be at least the minimum supported */
+	if (order < mp->min_order)
+		order = mp->min_order;
+
+	spin_lock(&mp->lock);
+	__buddy_free(mp, addr, order);
+	spin_unlock(&mp->lock);
+}
+
+
+/**
+ * Allocates up to count blocks of the requested size (2^order bytes) in one
+ * pass under the pool lock. Each larger block taken from a free list is split
+ * once: as many of its pieces as are still needed are handed out directly, and
+ * only the unused tail goes back on the free lists.
+ *
+ * Arguments:
+ *       [IN]  mp:     Buddy system memory allocator object.
+ *       [IN]  order:  Block size to allocate (2^order bytes).
+ *       [OUT] blocks: Array that receives the block addresses.
+ *       [IN]  count:  Number of blocks wanted.
+ *
+ * Returns:
+ *       The number of blocks stored in blocks[], which is less than count
+ *       only if the pool ran out.
+ */
+unsigned long
+buddy_alloc_bulk(
+	struct buddy_mempool *mp,
+	unsigned long order,
+	void **blocks,
+	unsigned long count
+)
+{
+	unsigned long n = 0;
+	unsigned long j;
+	unsigned long candidates;
+	unsigned long pieces;
+	unsigned long i;
+	unsigned long pos;
+	unsigned long k;
+	unsigned long block_id;
+	unsigned long tail_id;
+	struct block *block;
+
 	BUG_ON(mp == NULL);
 	BUG_ON(order > mp->pool_order);
 
+	/* Blocks never grow past a chunk */
+	if (order > mp->max_order)
+		return 0;
+
 	/* Fixup requested order to be at least the minimum supported */
 	if (order < mp->min_order)
 		order = mp->min_order;
 
-	/* Overlay block structure on the memory block being freed */
-	block = (struct block *) addr;
-	BUG_ON(is_available(mp, block));
+	spin_lock(&mp->lock);
 
-	/* Coalesce as much as possible with adjacent free buddy blocks */
-	while (order < mp->pool_order) {
-		/* Determine our buddy block's address */
-		struct block * buddy = find_buddy(mp, block, order);
+	while (n < count) {
+		candidates = mp->avail_orders & ~((1UL << order) - 1);
+		if (candidates == 0)
+			break;
 
-		/* Make sure buddy is available and has the same size as us */
-		if (!is_available(mp, buddy))
+		/* Take the first block of the smallest order that fits */
+		j = __ffs(candidates);
+		block_id = take_free(mp, j);
+		if (block_id == BLOCK_NONE)
 			break;
-		if (is_available(mp, buddy) && (buddy->order != order))
+
+		/* Hand out the pieces we need straight from the block */
+		pieces = min(1UL << (j - order), count - n);
+		for (i = 0; i < pieces; i++)
+			blocks[n++] = (void *)((unsigned long)id_to_addr(mp, block_id) + (i << order));
+		block = id_to_block(mp, block_id);
+		for (i = 0; i < (pieces << (order - mp->min_order)); i++)
+			block[i].owner = NULL;
+
+		/* Free what is left as the largest aligned blocks that fit */
+		for (pos = pieces << order; pos < (1UL << j); pos += (1UL << k)) {
+			k = __ffs(pos);
+			tail_id = block_id + (pos >> mp->min_order);
+			id_to_block(mp, tail_id)->order = k;
+			mark_available(mp, tail_id);
+			avail_add(mp, tail_id, k);
+		}
+	}
+
+	spin_unlock(&mp->lock);
+	return n;
+}
+
+
+static int
+cmp_block_addr(const void *a, const void *b)
+{
+	unsigned long x = *(const unsigned long *)a;
+	unsigned long y = *(const unsigned long *)b;
+
+	return (x > y) - (x < y);
+}
+
+
+/**
+ * Returns count blocks of the same size (2^order bytes) to the allocator in
+ * one pass under the pool lock. The array is sorted in place first, so
+ * neighbouring blocks are freed back to back and merge with each other.
+ */
+void
+buddy_free_bulk(
+	struct buddy_mempool *mp,
+	void **blocks,
+	unsigned long count,
+	unsigned long order
+)
+{
+	unsigned long i;
+
+	BUG_ON(mp == NULL);
+	BUG_ON(order > mp->max_order);
+
+	/* Fixup requested order to be at least the minimum supported */
+	if (order < mp->min_order)
+		order = mp->min_order;
+
+	sort(blocks, count, sizeof(void *), cmp_block_addr, NULL);
+
+	spin_lock(&mp->lock);
+	for (i = 0; i < count; i++)
+		__buddy_free(mp, blocks[i], order);
+	spin_unlock(&mp->lock);
+}
+
+
+/**
+ * Returns true if the 2^min_order block lies inside a free block. Only the
+ * heads of free blocks have their tag bit set, so this checks the one
+ * possible head at each order below a whole chunk. Caller holds mp->lock.
+ */
+static int
+in_free_block(struct buddy_mempool *mp, unsigned long block_id)
+{
+	unsigned long chunk_id = block_id >> mp->chunk_shift;
+	unsigned long head_id;
+	unsigned long k;
+
+	if (test_bit(chunk_id, mp->top_free) || !mp->chunks[chunk_id].blocks)
+		return 1;
+
+	for (k = mp->min_order; k < mp->max_order; k++) {
+		head_id = block_id & ~((1UL << (k - mp->min_order)) - 1);
+		if (is_available(mp, head_id) && id_to_block(mp, head_id)->order >= k)
+			return 1;
+	}
+	return 0;
+}
+
+
+/**
+ * Records who is using an allocated 2^min_order block, so the memory can be
+ * traced back to its user (e.g. the page table entry mapping a frame). No lock
+ * is taken: only the holder of the block may change its owner, and callers
+ * serialize that themselves. Cleared when the block is allocated.
+ */
+void
+buddy_set_owner(
+	struct buddy_mempool *mp,
+	const void *addr,
+	void *owner,
+	void *owner_data
+)
+{
+	struct block *block = id_to_block(mp, addr_to_id(mp, addr));
+
+	WRITE_ONCE(block->owner_data, owner_data);
+	WRITE_ONCE(block->owner, owner);
+}
+
+
+/**
+ * Returns the owner recorded for the block at addr and stores the second
+ * owner word in *owner_data. Free blocks, and allocated blocks that were not
+ * given an owner, return NULL.
+ */
+void *
+buddy_get_owner(
+	struct buddy_mempool *mp,
+	const void *addr,
+	void **owner_data
+)
+{
+	unsigned long block_id = addr_to_id(mp, addr);
+	struct block *block;
+	void *owner = NULL;
+
+	*owner_data = NULL;
+
+	/* Entries inside free blocks are never initialized */
+	spin_lock(&mp->lock);
+	if (!in_free_block(mp, block_id)) {
+		block = id_to_block(mp, block_id);
+		owner = READ_ONCE(block->owner);
+		*owner_data = READ_ONCE(block->owner_data);
+	}
+	spin_unlock(&mp->lock);
+
+	return owner;
+}
+
+
+/**
+ * Returns the number of free bytes in the pool.
+ */
+unsigned long
+buddy_free_bytes(struct buddy_mempool *mp)
+{
+	unsigned long i;
+	unsigned long bytes = 0;
+
+	spin_lock(&mp->lock);
+	for (i = mp->min_order; i <= mp->pool_order; i++)
+		bytes += mp->nr_free[i] << i;
+	spin_unlock(&mp->lock);
+
+	return bytes;
+}
+
+
+/**
+ * Returns how fragmented the free memory of a pool is with respect to blocks
+ * of 2^order bytes, from 0 (all free memory is in blocks at least that large)
+ * to 1000 (none of it is). An empty pool is not fragmented.
+ */
+unsigned long
+buddy_frag_index(struct buddy_mempool *mp, unsigned long order)
+{
+	unsigned long i;
+	unsigned long total = 0;
+	unsigned long usable = 0;
+
+	if (order < mp->min_order)
+		order = mp->min_order;
+
+	spin_lock(&mp->lock);
+	for (i = mp->min_order; i <= mp->pool_order; i++) {
+		total += mp->nr_free[i] << (i - mp->min_order);
+		if (i >= order)
+			usable += mp->nr_free[i] << (i - mp->min_order);
+	}
+	spin_unlock(&mp->lock);
+
+	if (total == 0)
+		return 0;
+
+	return ((total - usable) * 1000) / total;
+}
+
+
+/**
+ * Finds the aligned 2^order byte region of the pool that has the fewest
+ * allocated 2^min_order blocks, without being entirely free or entirely
+ * allocated. This is the cheapest region to empty to get a free block of
+ * that order back.
+ *
+ * The scan runs without the pool lock, so on a busy pool the answer is only
+ * a hint; the caller has to cope with the region having changed.
+ *
+ * Returns:
+ *       The number of allocated blocks in the region stored in *region,
+ *       or 0 if no such region was found.
+ */
+unsigned long
+buddy_sparse_region(
+	struct buddy_mempool *mp,
+	unsigned long order,
+	void **region
+)
+{
+	unsigned long pos = 0;
+	unsigned long end;
+	unsigned long start;
+	unsigned long used;
+	unsigned long best_used = 0;
+	unsigned long block_id;
+	unsigned long chunk_id;
+	unsigned long k;
+	struct buddy_chunk *chunk;
+	struct block *blocks;
+
+	BUG_ON(order > mp->max_order);
+
+	if (order < mp->min_order)
+		order = mp->min_order;
+
+	while (pos < (1UL << mp->pool_order)) {
+		/* A racing update can throw pos off a region boundary */
+		pos = ALIGN(pos, 1UL << order);
+		if (pos >= (1UL << mp->pool_order))
 			break;
+		start = pos;
+		end = pos + (1UL << order);
+		used = 0;
+
+		/* A region never spans chunks. A whole free chunk, or one that
+		 * was never split, covers it. */
+		chunk_id = pos >> mp->max_order;
+		chunk = &mp->chunks[chunk_id];
+		blocks = READ_ONCE(chunk->blocks);
+		if (test_bit(chunk_id, mp->top_free) || !blocks) {
+			pos = (chunk_id + 1) << mp->max_order;
+			continue;
+		}
+		smp_rmb();
+
+		while (pos < end) {
+			block_id = (pos >> mp->min_order) & ((1UL << mp->chunk_shift) - 1);
+			if (test_bit(block_id, chunk->tag_bits)) {
+				/* The head of a free block; blocks are aligned to their
+				 * size, so it either fits in the region or covers it */
+				k = READ_ONCE(blocks[block_id].order);
+				k = clamp(k, mp->min_order, mp->max_order);
+				pos += 1UL << k;
+			} else {
+				used++;
+				pos += 1UL << mp->min_order;
+			}
+		}
 
-		/* OK, we're good to go... buddy merge! */
-		list_del(&buddy->link);
-		if (buddy < block)
-			block = buddy;
-		++order;
-		block->order = order;
+		/* pos may have jumped over several free regions */
+		if (pos > end)
+			continue;
+
+		if (used == 0 || used == (1UL << (order - mp->min_order)))
+			continue;
+
+		if (best_used == 0 || used < best_used) {
+			best_used = used;
+			*region = (void *)(mp->base_addr + start);
+		}
 	}
 
-	/* Add the (possibly coalesced) block to the appropriate free list */
-	block->order = order;
-	mark_available(mp, block);
-	list_add(&block->link, &mp->avail[order]);
+	return best_used;
 }
 
 
@@ -259,21 +842,31 @@ buddy_dump_mempool(struct buddy_mempool *mp)
 {
 	unsigned long i;
 	unsigned long num_blocks;
-	struct list_head *entry;
+	u32 id;
 
 	printk(KERN_DEBUG "DUMP OF BUDDY MEMORY POOL:\n");
 	printk(KERN_DEBUG "  Pool Order=%lu, Min Order=%lu\n", 
 	       mp->pool_order, mp->min_order);
 
-	for (i = mp->min_order; i <= mp->pool_order; i++) {
+	spin_lock(&mp->lock);
+
+	for (i = mp->min_order; i <= mp->max_order; i++) {
 
 		/* Count the number of memory blocks in the list */
 		num_blocks = 0;
-		list_for_each(entry, &mp->avail[i])
-			++num_blocks;
+		if (i == mp->max_order)
+			num_blocks = bitmap_weight(mp->top_free, mp->nr_chunks);
+		else
+			for (id = mp->avail[i]; id != BLOCK_NONE; id = id_to_block(mp, id)->next)
+				++num_blocks;
 
 		printk(KERN_DEBUG "  order %2lu: %lu free blocks\n", i, num_blocks);
 	}
+
+	spin_unlock(&mp->lock);
+
+	printk(KERN_DEBUG "  Fragmentation index for order %lu: %lu/1000\n",
+	       mp->max_order, buddy_frag_index(mp, mp->max_order));
 }
 
 
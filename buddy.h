@@ -3,7 +3,9 @@
 #ifndef _LWK_BUDDY_H
 #define _LWK_BUDDY_H
 
+#include <linux/types.h>
 #include <linux/list.h>
+#include <linux/spinlock.h>
 
 /**
  * This structure stores the state of a buddy system memory allocator object.
@@ -13,29 +15,76 @@ struct buddy_mempool {
 	unsigned long    pool_order;   /** size of memory pool = 2^pool_order */
 	unsigned long    min_order;    /** minimum allocatable block size */
 
-	unsigned long    num_blocks;   /** number of bits in tag_bits */
-	unsigned long    *tag_bits;    /** one bit for each 2^min_order block
-	                                *   0 = block is allocated
-	                                *   1 = block is available
-	                                */
+	unsigned long    max_order;    /** largest block size, one chunk */
+	unsigned long    chunk_shift;  /** 2^chunk_shift min_order blocks per chunk */
+
+	unsigned long    num_blocks;   /** number of 2^min_order blocks */
+	unsigned long    nr_chunks;    /** number of chunks */
+	struct buddy_chunk *chunks;    /** metadata of each chunk, allocated on first split */
+	unsigned long    *top_free;    /** one bit for each chunk, 1 = whole chunk is free */
+	unsigned long    top_hint;     /** no free chunk below this one */
 
         struct list_head node;
 
-	struct list_head *avail;       /** one free list for each block size,
+	spinlock_t       lock;         /** protects avail, top_free and chunks */
+
+	u32              *avail;       /** one free list for each block size,
 	                                * indexed by block order:
-	                                *   avail[i] = free list of 2^i blocks
+	                                *   avail[i] = index of the first 2^i block,
+	                                *   BLOCK_NONE if there is none
 	                                */
+
+	unsigned long    avail_orders; /** bit i set iff avail[i] is not empty */
+
+	unsigned long    *nr_free;     /** nr_free[i] = number of blocks on avail[i],
+	                                *   or set in top_free for max_order */
+
+	int              pool_id;      /** slot of this pool in the owner's pool table */
+	int              nid;          /** NUMA node of the memory, set by the owner */
+
+	/** Optional callback, run under lock whenever avail[order] becomes
+	 *  non-empty (nonempty = 1) or empty (nonempty = 0). */
+	void (*order_hook)(struct buddy_mempool *mp, unsigned long order, int nonempty);
+};
+
+
+/** Block metadata is allocated per chunk of 2^BUDDY_CHUNK_SHIFT min_order blocks */
+#define BUDDY_CHUNK_SHIFT 9
+
+/**
+ * Tag bits and block entries of one chunk, NULL until the chunk is first split.
+ * Tag bit i is 1 iff block i of the chunk is the head of a free block.
+ */
+struct buddy_chunk {
+	unsigned long    *tag_bits;
+	struct block     *blocks;
 };
 
+/** Ends a free list, block indexes are 32 bits so a pool has fewer blocks than this */
+#define BLOCK_NONE ((u32)~0U)
 
 /**
- * Each free block has one of these structures at its head. The link member
- * provides linkage for the mp->avail[order] free list, where order is the
- * size of the free block.
+ * Each free block has one of these structures in its chunk's blocks[], at the
+ * index of its first 2^min_order block. next and prev link it into the mp->avail[order]
+ * free list by block index, where order is the size of the free block.
+ * Keeping them out of the blocks themselves means the allocator never touches
+ * the memory it manages, and 16 bytes per block keep four of them to a cache line.
+ *
+ * While a 2^min_order block is allocated the links and the order are unused,
+ * and whoever allocated it may keep two owner words there (see buddy_set_owner()).
  */
 struct block {
-	struct list_head link;
-	unsigned long    order;
+	union {
+		struct {
+			u32      next;
+			u32      prev;
+		};
+		void     *owner;
+	};
+	union {
+		u8       order;
+		void     *owner_data;
+	};
 };
 
 
@@ -51,6 +100,11 @@ buddy_deinit(
 	struct buddy_mempool * mp
 );
 
+extern void
+buddy_free_all(
+	struct buddy_mempool *mp
+);
+
 extern void *
 buddy_alloc(
 	struct buddy_mempool *mp,
@@ -65,6 +119,58 @@ buddy_free(
 );
 
 
+extern unsigned long
+buddy_alloc_bulk(
+	struct buddy_mempool *mp,
+	unsigned long order,
+	void **blocks,
+	unsigned long count
+);
+
+extern void
+buddy_free_bulk(
+	struct buddy_mempool *mp,
+	void **blocks,
+	unsigned long count,
+	unsigned long order
+);
+
+
+extern void
+buddy_set_owner(
+	struct buddy_mempool *mp,
+	const void *addr,
+	void *owner,
+	void *owner_data
+);
+
+extern void *
+buddy_get_owner(
+	struct buddy_mempool *mp,
+	const void *addr,
+	void **owner_data
+);
+
+
+extern unsigned long
+buddy_free_bytes(
+	struct buddy_mempool *mp
+);
+
+extern unsigned long
+buddy_frag_index(
+	struct buddy_mempool *mp,
+	unsigned long order
+);
+
+extern unsigned long
+buddy_sparse_region(
+	struct buddy_mempool *mp,
+	unsigned long order,
+	void **region
+);
+
+
 extern void
 buddy_dump_mempool(
 	struct buddy_mempool *mp
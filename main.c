@@ -7,97 +7,973 @@
 #include <linux/list.h>
 #include <linux/uaccess.h>
 #include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/spinlock.h>
+#include <linux/sort.h>
+#include <linux/seqlock.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
+#include <linux/topology.h>
+#include <linux/memory_hotplug.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <linux/vmalloc.h>
+#include <asm/tsc.h>
 
 #include "petmem.h"
 #include "buddy.h"
 #include "on_demand.h"
 #include "pgtables.h"
+#include "stats.h"
+
+#define CREATE_TRACE_POINTS
+#include "petmem_trace.h"
 
 MODULE_LICENSE("GPL");
 
 
+DEFINE_STATIC_KEY_FALSE(petmem_debug);
+
+static int petmem_debug_set(const char * val, const struct kernel_param * kp) {
+    bool on = false;
+    int ret = 0;
+
+    ret = kstrtobool(val, &on);
+    if (ret != 0) {
+	return ret;
+    }
+
+    if (on) {
+	static_branch_enable(&petmem_debug);
+    } else {
+	static_branch_disable(&petmem_debug);
+    }
+    return 0;
+}
+
+static int petmem_debug_get(char * buffer, const struct kernel_param * kp) {
+    return sprintf(buffer, "%d\n", static_key_enabled(&petmem_debug));
+}
+
+static const struct kernel_param_ops petmem_debug_ops = {
+    .set = petmem_debug_set,
+    .get = petmem_debug_get,
+};
+
+module_param_cb(debug, &petmem_debug_ops, NULL, 0644);
+MODULE_PARM_DESC(debug, "Print diagnostic output from the fault path");
+
+
 struct class * petmem_class = NULL;
 static struct cdev ctrl_dev;
 static int major_num = 0;
 
 
 LIST_HEAD(petmem_pool_list);
+/* Guards the pool list itself; each pool has its own lock for its free lists */
+static DEFINE_RWLOCK(petmem_pool_lock);
+
+
+/* Every pool also sits in petmem_pools[pool_id], and a summary records which
+ * pools can satisfy which orders: pools_with_order[n][j] has a pool's bit set while
+ * the pool is on NUMA node n and its order j free list is non-empty.
+ * node_orders_nonempty[n] has bit j set while any pool on node n has a block of
+ * order j, and orders_nonempty while any pool at all does. Finding a block is then
+ * an ffs on the node's orders and another on pools_with_order[n][j], instead of a
+ * walk over every order of every pool. Nodes are tried nearest first, see
+ * petmem_node_fallback.
+ */
+#define PETMEM_MAX_POOLS 1024
+
+static struct buddy_mempool * petmem_pools[PETMEM_MAX_POOLS];
+static int petmem_num_pools = 0;
+
+/* The same pools sorted by base address, so the lookup on every free is a binary
+ * search. Pools are only ever added; lookups retry if one was added meanwhile. */
+static struct buddy_mempool * petmem_pool_index[PETMEM_MAX_POOLS];
+static DEFINE_SEQLOCK(petmem_pool_index_lock);
+static unsigned long (* pools_with_order)[BITS_PER_LONG][BITS_TO_LONGS(PETMEM_MAX_POOLS)] = NULL; // nr_node_ids of them
+static unsigned long orders_nonempty = 0;
+static unsigned long node_orders_nonempty[MAX_NUMNODES];
+
+/* Row n lists every node id by distance from node n, n itself first */
+static int * petmem_node_fallback = NULL;
+
+/* Frames handed out of the pools, by whether the pool was on the requesting CPU's node.
+ * Per CPU so the fault path never shares a counter line; summed per node when read. */
+struct node_alloc_stats {
+    unsigned long local;
+    unsigned long remote;
+};
 
-/* does this function return 0 when there is no physical memory available? */
-uintptr_t petmem_alloc_pages(u64 num_pages) {
+static DEFINE_PER_CPU(struct node_alloc_stats, petmem_alloc_stats);
+
+static int node_has_order(int nid, unsigned long order) {
+    return !bitmap_empty(pools_with_order[nid][order], PETMEM_MAX_POOLS);
+}
+
+static int any_node_has_order(unsigned long order) {
+    int nid = 0;
+
+    for (nid = 0; nid < nr_node_ids; nid++) {
+	if (test_bit(order, &node_orders_nonempty[nid])) {
+	    return 1;
+	}
+    }
+    return 0;
+}
+
+/* Runs under the pool's lock, so a pool's own bits are always exact */
+static void petmem_order_hook(struct buddy_mempool * mp, unsigned long order, int nonempty) {
+    if (nonempty) {
+	set_bit(mp->pool_id, pools_with_order[mp->nid][order]);
+	set_bit(order, &node_orders_nonempty[mp->nid]);
+	set_bit(order, &orders_nonempty);
+	return;
+    }
+
+    clear_bit(mp->pool_id, pools_with_order[mp->nid][order]);
+    if (!node_has_order(mp->nid, order)) {
+	clear_bit(order, &node_orders_nonempty[mp->nid]);
+	// Another pool on the node may have gained a block of this order in between
+	smp_mb__after_atomic();
+	if (node_has_order(mp->nid, order)) {
+	    set_bit(order, &node_orders_nonempty[mp->nid]);
+	}
+    }
+    if (!any_node_has_order(order)) {
+	clear_bit(order, &orders_nonempty);
+	// Another pool may have gained a block of this order in between
+	smp_mb__after_atomic();
+	if (any_node_has_order(order)) {
+	    set_bit(order, &orders_nonempty);
+	}
+    }
+}
+
+
+/* Order-0 frames are handed out from a small per-CPU stack that is refilled from
+ * and drained to the buddy pools in batches. The lock is only ever contended
+ * when another CPU drains the cache because the pools ran dry.
+ */
+#define FRAME_CACHE_HIGH  64
+#define FRAME_CACHE_BATCH 16
+
+struct frame_cache {
+    spinlock_t lock;
+    unsigned int count;
+    uintptr_t frames[FRAME_CACHE_HIGH]; // kernel virtual addresses, like buddy hands out
+};
+
+static DEFINE_PER_CPU(struct frame_cache, petmem_frame_caches);
+
+
+/* Pre-zeroed frames, one pool per NUMA node. petmem_zerod tops them up at the lowest
+ * priority, so in practice when CPUs are idle, and zeroes with non-temporal stores.
+ * Frames are only taken from a node's pools while it has plenty free, and the pools
+ * are drained back when an allocation would fail otherwise. */
+#define ZERO_POOL_HIGH 128
+#define ZERO_POOL_LOW  32
+#define ZERO_POOL_RESERVE (4 * ZERO_POOL_HIGH) /* free pages a node keeps besides its zero pool */
+
+struct zero_pool {
+    spinlock_t lock;
+    unsigned int count;
+    uintptr_t frames[ZERO_POOL_HIGH]; // kernel virtual addresses
+};
+
+static struct zero_pool * petmem_zero_pools = NULL; // nr_node_ids of them
+static struct task_struct * petmem_zerod = NULL;
+static DECLARE_WAIT_QUEUE_HEAD(petmem_zero_wait);
+static int petmem_zero_kick = 0; // set with the wake up, so a pool that cannot be refilled does not keep it awake
+
+
+/* Background compaction: once most free memory in a pool is in pieces smaller than a
+ * huge page, the emptiest huge page sized region is evacuated by moving its pages
+ * elsewhere, so it coalesces back into one block. Runs periodically, and right away
+ * when a multi-page allocation fails, at most once per COMPACT_KICK_INTERVAL.
+ */
+#define COMPACT_ORDER          (PAGE_SHIFT + 9)
+#define COMPACT_FRAG_THRESHOLD 500 /* out of 1000, see buddy_frag_index() */
+#define COMPACT_INTERVAL       (5 * HZ)
+#define COMPACT_KICK_INTERVAL  (HZ / 10)
+
+/* Below this share of free pool memory the same work also swaps out idle page tables */
+#define TABLE_RECLAIM_FREE_PCT 10
+
+static void petmem_compact_work(struct work_struct * work);
+static DECLARE_DELAYED_WORK(petmem_compact_dwork, petmem_compact_work);
+static unsigned long petmem_compact_kicked = 0; // jiffies of the last early run
+
+
+/* Picks a pool on node nid that the summary says has a free block of at least page_order */
+static struct buddy_mempool * pick_pool_on_node(int page_order, int nid) {
+    unsigned long candidates = 0;
+    unsigned long order = 0;
+    unsigned long pool_id = 0;
+
+    candidates = READ_ONCE(node_orders_nonempty[nid]) & ~((1UL << page_order) - 1);
+
+    // Smallest order first, so large blocks are only split when nothing else fits.
+    // The node's bit can be stale for a moment, then the next order is tried.
+    for_each_set_bit(order, &candidates, BITS_PER_LONG) {
+	pool_id = find_first_bit(pools_with_order[nid][order], PETMEM_MAX_POOLS);
+	if (pool_id < PETMEM_MAX_POOLS) {
+	    return petmem_pools[pool_id];
+	}
+    }
+
+    return NULL;
+}
+
+/* Picks a pool with a free block of at least page_order, as close to node nid as possible */
+static struct buddy_mempool * pick_pool(int page_order, int nid) {
+    struct buddy_mempool * pool = NULL;
+    int i = 0;
+
+    if ((READ_ONCE(orders_nonempty) & ~((1UL << page_order) - 1)) == 0) {
+	return NULL;
+    }
+
+    for (i = 0; i < nr_node_ids; i++) {
+	pool = pick_pool_on_node(page_order, petmem_node_fallback[(nid * nr_node_ids) + i]);
+	if (pool) {
+	    return pool;
+	}
+    }
+
+    return NULL;
+}
+
+static void count_alloc(struct buddy_mempool * pool, int nid, unsigned long n) {
+    if (pool->nid == nid) {
+	this_cpu_add(petmem_alloc_stats.local, n);
+    } else {
+	this_cpu_add(petmem_alloc_stats.remote, n);
+    }
+}
+
+static uintptr_t buddy_pools_alloc(int page_order, int nid) {
     uintptr_t vaddr = 0;
     struct buddy_mempool * tmp_pool = NULL;
-    int page_order = get_order(num_pages * PAGE_SIZE) + PAGE_SHIFT; // PAGE_SHIFT is the number of bits to shift one bit left to get the PAGE_SIZE value; by default on x86 it should be 12, 2^12=4KB.
+    int tries = 0;
 
+    for (tries = 0; tries < 4; tries++) {
+	tmp_pool = pick_pool(page_order, nid);
+	if (tmp_pool == NULL) {
+	    return 0;
+	}
+
+	// Another CPU may have taken the block since we looked, then just look again
+	vaddr = (uintptr_t)buddy_alloc(tmp_pool, page_order);
+	if (vaddr) {
+	    count_alloc(tmp_pool, nid, 1);
+	    return vaddr;
+	}
+    }
+
+    // Lost every race above, fall back to asking each pool
+    read_lock(&petmem_pool_lock);
     // allocate from buddy
     list_for_each_entry(tmp_pool, &petmem_pool_list, node) {
 	    // Get allocation size order
         vaddr = (uintptr_t)buddy_alloc(tmp_pool, page_order);
-        if (vaddr) break;
+        if (vaddr) {
+	    count_alloc(tmp_pool, nid, 1);
+	    break;
+	}
+    }
+    read_unlock(&petmem_pool_lock);
+
+    return vaddr;
+}
+
+/* Fills vaddrs[] with up to count blocks of page_order, splitting large blocks once.
+ * With local_only set only pools on node nid are used. */
+static unsigned long buddy_pools_alloc_bulk(int page_order, uintptr_t * vaddrs, unsigned long count,
+					    int nid, int local_only) {
+    struct buddy_mempool * tmp_pool = NULL;
+    unsigned long n = 0;
+    unsigned long got = 0;
+    int misses = 0;
+
+    while ((n < count) && (misses < 4)) {
+	if (local_only) {
+	    tmp_pool = pick_pool_on_node(page_order, nid);
+	} else {
+	    tmp_pool = pick_pool(page_order, nid);
+	}
+	if (tmp_pool == NULL) {
+	    break;
+	}
+
+	got = buddy_alloc_bulk(tmp_pool, page_order, (void **)(vaddrs + n), count - n);
+	if (got == 0) {
+	    misses++;
+	}
+	count_alloc(tmp_pool, nid, got);
+	n += got;
+    }
+
+    return n;
+}
+
+/* Pools are never removed, so the result stays valid after the lookup */
+static struct buddy_mempool * find_pool(uintptr_t page_va) {
+    struct buddy_mempool * tmp_pool = NULL;
+    struct buddy_mempool * found = NULL;
+    unsigned int seq = 0;
+    int lo = 0;
+    int hi = 0;
+    int mid = 0;
+
+    do {
+	seq = read_seqbegin(&petmem_pool_index_lock);
+	found = NULL;
+	lo = 0;
+	hi = petmem_num_pools;
+
+	while (lo < hi) {
+	    mid = lo + (hi - lo) / 2;
+	    tmp_pool = petmem_pool_index[mid];
+
+	    if (page_va < tmp_pool->base_addr) {
+		hi = mid;
+	    } else if (page_va >= tmp_pool->base_addr + (1UL << tmp_pool->pool_order)) {
+		lo = mid + 1;
+	    } else {
+		found = tmp_pool;
+		break;
+	    }
+	}
+    } while (read_seqretry(&petmem_pool_index_lock, seq));
+
+    return found;
+}
+
+/* Makes a new pool visible to allocation and lookup. Returns -1 if the table is full. */
+static int register_pool(struct buddy_mempool * mp) {
+    int i = 0;
+
+    write_lock(&petmem_pool_lock);
+    if (petmem_num_pools == PETMEM_MAX_POOLS) {
+	write_unlock(&petmem_pool_lock);
+	return -1;
+    }
+
+    mp->pool_id = petmem_num_pools;
+    mp->order_hook = petmem_order_hook;
+    petmem_pools[petmem_num_pools] = mp;
+    list_add(&(mp->node), &petmem_pool_list);
+
+    // Insertion sort into the index, pools are added rarely
+    write_seqlock(&petmem_pool_index_lock);
+    for (i = petmem_num_pools; (i > 0) && (petmem_pool_index[i - 1]->base_addr > mp->base_addr); i--) {
+	petmem_pool_index[i] = petmem_pool_index[i - 1];
+    }
+    petmem_pool_index[i] = mp;
+    petmem_num_pools++;
+    write_sequnlock(&petmem_pool_index_lock);
+
+    write_unlock(&petmem_pool_lock);
+    return 0;
+}
+
+static void buddy_pools_free(uintptr_t page_va, int page_order) {
+    struct buddy_mempool * tmp_pool = find_pool(page_va);
+
+    if (tmp_pool) {
+	buddy_free(tmp_pool, (void *)page_va, page_order);
+    }
+}
+
+static int cmp_vaddr(const void * a, const void * b) {
+    uintptr_t x = *(const uintptr_t *)a;
+    uintptr_t y = *(const uintptr_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+/* Frees count blocks of page_order. Sorting first puts each pool's blocks next to
+ * each other, so every pool is locked once for its whole run. */
+static void buddy_pools_free_bulk(uintptr_t * vaddrs, unsigned long count, int page_order) {
+    struct buddy_mempool * tmp_pool = NULL;
+    unsigned long i = 0;
+    unsigned long run = 0;
+    uintptr_t pool_end = 0;
+
+    sort(vaddrs, count, sizeof(uintptr_t), cmp_vaddr, NULL);
+
+    while (i < count) {
+	tmp_pool = find_pool(vaddrs[i]);
+	if (tmp_pool == NULL) {
+	    i++;
+	    continue;
+	}
+
+	pool_end = tmp_pool->base_addr + (1UL << tmp_pool->pool_order);
+	for (run = 1; (i + run < count) && (vaddrs[i + run] < pool_end); run++);
+
+	buddy_free_bulk(tmp_pool, (void **)(vaddrs + i), run, page_order);
+	i += run;
+    }
+}
+
+/* Returns the count oldest frames of a cache to the buddy pools. Caller holds cache->lock. */
+static void frame_cache_drain(struct frame_cache * cache, unsigned int count) {
+    if (count > cache->count) {
+	count = cache->count;
+    }
+
+    buddy_pools_free_bulk(cache->frames, count, PAGE_SHIFT);
+
+    cache->count -= count;
+    memmove(cache->frames, cache->frames + count, cache->count * sizeof(uintptr_t));
+}
+
+static uintptr_t frame_cache_alloc(void) {
+    struct frame_cache * cache = get_cpu_ptr(&petmem_frame_caches);
+    uintptr_t vaddr = 0;
+
+    spin_lock(&(cache->lock));
+
+    if (cache->count == 0) {
+	// Refill a whole batch so the pools are only visited once every FRAME_CACHE_BATCH faults.
+	// Only with local frames, remote ones are handed out one at a time as a last resort.
+	cache->count = buddy_pools_alloc_bulk(PAGE_SHIFT, cache->frames, FRAME_CACHE_BATCH,
+					      numa_node_id(), 1);
+    }
+
+    if (cache->count > 0) {
+	vaddr = cache->frames[--cache->count];
+    }
+
+    spin_unlock(&(cache->lock));
+    put_cpu_ptr(&petmem_frame_caches);
+
+    return vaddr;
+}
+
+static void frame_cache_free(uintptr_t page_va) {
+    struct frame_cache * cache = get_cpu_ptr(&petmem_frame_caches);
+
+    spin_lock(&(cache->lock));
+
+    if (cache->count == FRAME_CACHE_HIGH) {
+	frame_cache_drain(cache, FRAME_CACHE_BATCH);
+    }
+    cache->frames[cache->count++] = page_va;
+
+    spin_unlock(&(cache->lock));
+    put_cpu_ptr(&petmem_frame_caches);
+}
+
+/* Pulls every cached frame back into the pools, so nothing is stranded on another CPU.
+ * Empty caches are skipped without touching their lock. Returns how many came back. */
+static unsigned long frame_cache_drain_all(void) {
+    unsigned long drained = 0;
+    int cpu;
+
+    for_each_possible_cpu(cpu) {
+	struct frame_cache * cache = per_cpu_ptr(&petmem_frame_caches, cpu);
+
+	if (READ_ONCE(cache->count) == 0) {
+	    continue;
+	}
+
+	spin_lock(&(cache->lock));
+	drained += cache->count;
+	frame_cache_drain(cache, cache->count);
+	spin_unlock(&(cache->lock));
+    }
+
+    return drained;
+}
+
+
+static unsigned long long node_free_pages(int nid) {
+    unsigned long long free = 0;
+    int num_pools = 0;
+    int i = 0;
+
+    read_lock(&petmem_pool_lock);
+    num_pools = petmem_num_pools;
+    read_unlock(&petmem_pool_lock);
+
+    for (i = 0; i < num_pools; i++) {
+	if (petmem_pools[i]->nid == nid) {
+	    free += buddy_free_bytes(petmem_pools[i]) >> PAGE_SHIFT;
+	}
+    }
+
+    return free;
+}
+
+/* Free pages in the buddy pools, frames parked in the frame caches and zero pools not included */
+unsigned long long petmem_pool_free_pages(void) {
+    unsigned long long free = 0;
+    int num_pools = 0;
+    int i = 0;
+
+    read_lock(&petmem_pool_lock);
+    num_pools = petmem_num_pools;
+    read_unlock(&petmem_pool_lock);
+
+    for (i = 0; i < num_pools; i++) {
+	free += buddy_free_bytes(petmem_pools[i]) >> PAGE_SHIFT;
+    }
+
+    return free;
+}
+
+static void zero_pool_refill(int nid) {
+    struct zero_pool * pool = &(petmem_zero_pools[nid]);
+    uintptr_t vaddr = 0;
+
+    while ((READ_ONCE(pool->count) < ZERO_POOL_HIGH) && (node_free_pages(nid) > ZERO_POOL_RESERVE)) {
+	if (buddy_pools_alloc_bulk(PAGE_SHIFT, &vaddr, 1, nid, 1) == 0) {
+	    return;
+	}
+	clear_page_nt((void *)vaddr);
+
+	spin_lock(&(pool->lock));
+	if (pool->count < ZERO_POOL_HIGH) {
+	    pool->frames[pool->count++] = vaddr;
+	    vaddr = 0;
+	}
+	spin_unlock(&(pool->lock));
+
+	if (vaddr) {
+	    buddy_pools_free_bulk(&vaddr, 1, PAGE_SHIFT);
+	}
+	cond_resched();
+    }
+}
+
+/* Hands pre-zeroed frames back to the buddy pools, when memory is needed more than zeroes.
+ * Returns how many came back. */
+static unsigned long zero_pool_drain_all(void) {
+    struct zero_pool * pool = NULL;
+    unsigned long drained = 0;
+    int nid = 0;
+
+    for (nid = 0; nid < nr_node_ids; nid++) {
+	pool = &(petmem_zero_pools[nid]);
+
+	if (READ_ONCE(pool->count) == 0) {
+	    continue;
+	}
+
+	spin_lock(&(pool->lock));
+	drained += pool->count;
+	buddy_pools_free_bulk(pool->frames, pool->count, PAGE_SHIFT);
+	pool->count = 0;
+	spin_unlock(&(pool->lock));
+    }
+
+    return drained;
+}
+
+static int petmem_zerod_fn(void * data) {
+    int nid = 0;
+
+    set_user_nice(current, MAX_NICE);
+
+    while (!kthread_should_stop()) {
+	// Cleared first, a kick that comes in while we refill gets another pass
+	WRITE_ONCE(petmem_zero_kick, 0);
+	for (nid = 0; nid < nr_node_ids; nid++) {
+	    zero_pool_refill(nid);
+	}
+
+	// Also look again now and then, memory may have been freed or added meanwhile
+	wait_event_interruptible_timeout(petmem_zero_wait, kthread_should_stop() || READ_ONCE(petmem_zero_kick), HZ);
+    }
+
+    return 0;
+}
+
+static int petmem_zero_pools_init(void) {
+    int nid = 0;
+
+    petmem_zero_pools = kcalloc(nr_node_ids, sizeof(struct zero_pool), GFP_KERNEL);
+
+    if (petmem_zero_pools == NULL) {
+	return -1;
+    }
+
+    for (nid = 0; nid < nr_node_ids; nid++) {
+	spin_lock_init(&(petmem_zero_pools[nid].lock));
     }
 
+    petmem_zerod = kthread_run(petmem_zerod_fn, NULL, "petmem_zerod");
+
+    if (IS_ERR(petmem_zerod)) {
+	kfree(petmem_zero_pools);
+	return -1;
+    }
+
+    return 0;
+}
+
+static void petmem_zero_pools_exit(void) {
+    kthread_stop(petmem_zerod);
+    zero_pool_drain_all();
+    kfree(petmem_zero_pools);
+}
+
+
+/* Takes up to count zeroed frames from this node's pool. Returns how many, the caller
+ * allocates and zeroes the rest itself. */
+unsigned long petmem_alloc_zeroed_pages(uintptr_t * frames, unsigned long count) {
+    int nid = numa_node_id();
+    struct zero_pool * pool = &(petmem_zero_pools[nid]);
+    unsigned long n = 0;
+    int low = 0;
+
+    spin_lock(&(pool->lock));
+    while ((n < count) && (pool->count > 0)) {
+	frames[n] = (uintptr_t)__pa(pool->frames[--pool->count]);
+	trace_petmem_alloc(frames[n++], 1);
+    }
+    low = (pool->count < ZERO_POOL_LOW);
+    spin_unlock(&(pool->lock));
+
+    // Only worth a wake up if the node has memory to spare for zeroes
+    if (low && !READ_ONCE(petmem_zero_kick) && (node_free_pages(nid) > ZERO_POOL_RESERVE)) {
+	WRITE_ONCE(petmem_zero_kick, 1);
+	wake_up(&petmem_zero_wait);
+    }
+
+    return n;
+}
+
+
+/* Runs compaction now, unless it was already brought forward in the last
+ * COMPACT_KICK_INTERVAL; failed allocations come in bursts. */
+static void compact_kick(void) {
+    unsigned long last = READ_ONCE(petmem_compact_kicked);
+
+    if (time_before(jiffies, last + COMPACT_KICK_INTERVAL)) {
+	return;
+    }
+    // One CPU per interval gets to requeue the work
+    if (cmpxchg(&petmem_compact_kicked, last, jiffies) != last) {
+	return;
+    }
+    mod_delayed_work(system_wq, &petmem_compact_dwork, 0);
+}
+
+/* does this function return 0 when there is no physical memory available? */
+uintptr_t petmem_alloc_pages(u64 num_pages) {
+    uintptr_t vaddr = 0;
+    int page_order = get_order(num_pages * PAGE_SIZE) + PAGE_SHIFT; // PAGE_SHIFT is the number of bits to shift one bit left to get the PAGE_SIZE value; by default on x86 it should be 12, 2^12=4KB.
+    int nid = numa_node_id();
+
+    if (num_pages == 1) {
+	vaddr = frame_cache_alloc();
+    }
+
+    if (!vaddr) {
+	vaddr = buddy_pools_alloc(page_order, nid);
+    }
+
+    if (!vaddr) {
+	if (num_pages > 1) {
+	    compact_kick();
+	}
+	petmem_dbg("Failed to allocate %llu pages\n", num_pages);
+	return (uintptr_t)NULL;
+    }
+
+    trace_petmem_alloc(__pa(vaddr), num_pages);
+    return (uintptr_t)__pa(vaddr);
+}
+
+
+/* Opportunistic allocation straight from the pools: no frame caches, no compaction
+ * kick. For callers with a cheaper fallback, like huge pages falling back to 4 KB. */
+uintptr_t petmem_try_alloc_pages(u64 num_pages) {
+    int page_order = get_order(num_pages * PAGE_SIZE) + PAGE_SHIFT;
+    uintptr_t vaddr = 0;
+
+    vaddr = buddy_pools_alloc(page_order, numa_node_id());
     if (!vaddr) {
-	printk("Failed to allocate %llu pages\n", num_pages);
 	return (uintptr_t)NULL;
     }
 
+    trace_petmem_alloc(__pa(vaddr), num_pages);
     return (uintptr_t)__pa(vaddr);
 }
 
 
 void petmem_free_pages(uintptr_t page_addr, u64 num_pages) {
-    struct buddy_mempool * tmp_pool = NULL;
     int page_order = get_order(num_pages * PAGE_SIZE) + PAGE_SHIFT;
     uintptr_t page_va = (uintptr_t)__va(page_addr);
 
-    printk("Freeing %llu pages at %p\n", num_pages, (void *)page_va);
+    struct buddy_mempool * pool = NULL;
 
-    list_for_each_entry(tmp_pool, &petmem_pool_list, node) {
-	if ((page_va >= tmp_pool->base_addr) &&
-	    (page_va < tmp_pool->base_addr + (0x1 << tmp_pool->pool_order))) {
+    trace_petmem_free(page_addr, num_pages);
 
-        printk("Actually freeing it.\n");
-	    buddy_free(tmp_pool, (void *)page_va, page_order);
-	    break;
-	}
+    // Only frames that belong to a pool may end up in a frame cache
+    pool = find_pool(page_va);
+    if (pool == NULL) {
+	return;
+    }
+
+    // and only local ones, the cache is handed out as local memory
+    if ((num_pages == 1) && (pool->nid == numa_node_id())) {
+	frame_cache_free(page_va);
+    } else {
+	buddy_pools_free(page_va, page_order);
     }
 
     return;
 }
 
 
+/* Last resort once the pools are dry and the caller could not evict anything: frames
+ * parked in other CPUs' caches and in the zero pools go back to the pools. Touches every
+ * CPU's cache, so the fault path only comes here after eviction failed. Returns how
+ * many frames came back, 0 means retrying the allocation is pointless. */
+unsigned long petmem_drain_cached_frames(void) {
+    return frame_cache_drain_all() + zero_pool_drain_all();
+}
+
+
+/* Allocates up to count single frames in one go and stores their physical addresses
+ * in frames[]. Returns how many were allocated. Only free pool memory is used, the
+ * frames parked in caches are left to allocations that cannot do without. */
+unsigned long petmem_alloc_pages_bulk(uintptr_t * frames, unsigned long count) {
+    unsigned long n = 0;
+    unsigned long i = 0;
+    int nid = numa_node_id();
+
+    n = buddy_pools_alloc_bulk(PAGE_SHIFT, frames, count, nid, 0);
+
+    for (i = 0; i < n; i++) {
+	frames[i] = (uintptr_t)__pa(frames[i]);
+	trace_petmem_alloc(frames[i], 1);
+    }
+
+    return n;
+}
+
+/* Returns count single frames, given by physical address, straight to the pools.
+ * The array is reordered. */
+void petmem_free_pages_bulk(uintptr_t * frames, unsigned long count) {
+    unsigned long i = 0;
+
+    for (i = 0; i < count; i++) {
+	trace_petmem_free(frames[i], 1);
+	frames[i] = (uintptr_t)__va(frames[i]);
+    }
+
+    buddy_pools_free_bulk(frames, count, PAGE_SHIFT);
+}
+
+
+/* Frame owners make a reverse map from frames to whatever maps them. They are kept
+ * in the pool's block metadata; frames outside the pools cannot have an owner. */
+void petmem_set_frame_owner(uintptr_t frame, void * owner, void * owner_data) {
+    uintptr_t page_va = (uintptr_t)__va(frame);
+    struct buddy_mempool * pool = find_pool(page_va);
+
+    if (pool == NULL) {
+	return;
+    }
+
+    buddy_set_owner(pool, (void *)page_va, owner, owner_data);
+}
+
+void * petmem_frame_owner(uintptr_t frame, void ** owner_data) {
+    uintptr_t page_va = (uintptr_t)__va(frame);
+    struct buddy_mempool * pool = find_pool(page_va);
+
+    if (pool == NULL) {
+	*owner_data = NULL;
+	return NULL;
+    }
+
+    return buddy_get_owner(pool, (void *)page_va, owner_data);
+}
+
+
+/* drained is set once the frame caches have been emptied in this pass */
+static void compact_pool(struct buddy_mempool * mp, int * drained) {
+    void * region = NULL;
+    unsigned long used = 0;
+    int moved = 0;
+
+    if (mp->max_order < COMPACT_ORDER) {
+	return;
+    }
+
+    if (buddy_frag_index(mp, COMPACT_ORDER) < COMPACT_FRAG_THRESHOLD) {
+	return;
+    }
+
+    // Frames parked in the caches look allocated and would pin their regions
+    if (!*drained) {
+	frame_cache_drain_all();
+	*drained = 1;
+    }
+
+    // Only worth it if at least half the region is free already
+    used = buddy_sparse_region(mp, COMPACT_ORDER, &region);
+    if ((used == 0) || (used > (1UL << (COMPACT_ORDER - PAGE_SHIFT)) / 2)) {
+	return;
+    }
+
+    moved = petmem_evacuate_range(__pa(region), __pa(region) + (1UL << COMPACT_ORDER));
+
+    petmem_dbg("Compaction moved %d of %lu pages out of %p (pool %d)\n",
+	       moved, used, region, mp->pool_id);
+}
+
+static void petmem_compact_work(struct work_struct * work) {
+    unsigned long long total = 0;
+    unsigned long long free = 0;
+    int num_pools = 0;
+    int drained = 0;
+    int swapped = 0;
+    int i = 0;
+
+    read_lock(&petmem_pool_lock);
+    num_pools = petmem_num_pools;
+    read_unlock(&petmem_pool_lock);
+
+    for (i = 0; i < num_pools; i++) {
+	compact_pool(petmem_pools[i], &drained);
+
+	total += 1ULL << petmem_pools[i]->pool_order;
+	free += buddy_free_bytes(petmem_pools[i]);
+    }
+
+    if ((total != 0) && (free * 100 < total * TABLE_RECLAIM_FREE_PCT)) {
+	swapped = petmem_reclaim_tables();
+	if (swapped != 0) {
+	    petmem_dbg("Swapped out %d page tables\n", swapped);
+	}
+    }
+
+    schedule_delayed_work(&petmem_compact_dwork, COMPACT_INTERVAL);
+}
+
+
+/* Allocator microbenchmark, for BUDDY_BENCH. The allocator keeps all its metadata out
+ * of the memory it manages, so a scratch pool can describe an address range that is
+ * never touched. Pages are allocated one by one and freed in shuffled order, so the
+ * frees merge all over the pool the way they do after a long run. */
+#define BUDDY_BENCH_ORDER  (PAGE_SHIFT + 18) /* 1 GB of pages, more metadata than fits in cache */
+#define BUDDY_BENCH_PAGES  (1UL << 16)
+#define BUDDY_BENCH_ROUNDS 16
+
+static int buddy_bench_run(struct buddy_bench * bench) {
+    struct buddy_mempool * mp = NULL;
+    void ** pages = NULL;
+    void * tmp = NULL;
+    unsigned long long alloc_cycles = 0;
+    unsigned long long free_cycles = 0;
+    unsigned long round = 0;
+    unsigned long i = 0;
+    unsigned long j = 0;
+    u32 seed = 1;
+    u64 tsc = 0;
+
+    mp = buddy_init(1UL << BUDDY_BENCH_ORDER, BUDDY_BENCH_ORDER, PAGE_SHIFT);
+    pages = vmalloc(BUDDY_BENCH_PAGES * sizeof(void *));
+
+    if ((mp == NULL) || (pages == NULL)) {
+	if (mp) {
+	    buddy_deinit(mp);
+	}
+	vfree(pages);
+	return -ENOMEM;
+    }
+
+    buddy_free_all(mp);
+
+    for (round = 0; round < BUDDY_BENCH_ROUNDS; round++) {
+	tsc = rdtsc_ordered();
+	for (i = 0; i < BUDDY_BENCH_PAGES; i++) {
+	    pages[i] = buddy_alloc(mp, PAGE_SHIFT);
+	}
+	alloc_cycles += rdtsc_ordered() - tsc;
+
+	// Fisher-Yates with xorshift32, the same order on every run
+	for (i = BUDDY_BENCH_PAGES - 1; i > 0; i--) {
+	    seed ^= seed << 13;
+	    seed ^= seed >> 17;
+	    seed ^= seed << 5;
+	    j = seed % (i + 1);
+	    tmp = pages[i];
+	    pages[i] = pages[j];
+	    pages[j] = tmp;
+	}
+
+	tsc = rdtsc_ordered();
+	for (i = 0; i < BUDDY_BENCH_PAGES; i++) {
+	    buddy_free(mp, pages[i], PAGE_SHIFT);
+	}
+	free_cycles += rdtsc_ordered() - tsc;
+
+	cond_resched();
+    }
+
+    bench->pairs = BUDDY_BENCH_PAGES * BUDDY_BENCH_ROUNDS;
+    bench->alloc_cycles = alloc_cycles / bench->pairs;
+    bench->free_cycles = free_cycles / bench->pairs;
+
+    buddy_deinit(mp);
+    vfree(pages);
+    return 0;
+}
+
+
 static long petmem_ioctl(struct file * filp,
 			 unsigned int ioctl, unsigned long arg) {
     void __user * argp = (void __user *)arg;
 
 
-    printk("petmem ioctl\n");
+    petmem_dbg("petmem ioctl %u\n", ioctl);
 
     switch (ioctl) {
 	case ADD_MEMORY: {
 	    struct memory_range reg;
 	    int reg_order = 0;
 	    uintptr_t base_addr = 0;
-	    u32 num_pages = 0;
+	    u64 num_pages = 0;
+	    int num_added = 0;
+	    ktime_t start;
 
 	    if (copy_from_user(&reg, argp, sizeof(struct memory_range))) {
 		printk("Error copying memory region from user space\n");
 		return -EFAULT;
 	    };
 
+	    start = ktime_get();
 
 	    base_addr = (uintptr_t)__va(reg.base_addr);
-	    num_pages = reg.pages/64;
-
-	    // The order is equal to the highest order bit; ffs returns the position of the most significant set bit.
-	    for (reg_order = fls(num_pages); reg_order != 0; reg_order = fls(num_pages)) {
+	    num_pages = reg.pages;
+
+	    /* Pools are powers of two, largest first, and each is aligned to its own size, so every
+	     * block buddy hands out is naturally aligned and 2 MB blocks can back large pages.
+	     * An unaligned start gets small pools until it is aligned. Each pool starts out as
+	     * a bitmap of free 2 MB chunks; block metadata is only allocated for a chunk when
+	     * it is first split, so bring-up costs a few bytes per chunk. */
+	    for (reg_order = fls64(num_pages); reg_order != 0; reg_order = fls64(num_pages)) {
 		struct buddy_mempool * tmp_pool = NULL;
+		u64 pfn = __pa(base_addr) >> PAGE_SHIFT;
 
-		printk("Adding pool of order %d (%d pages) at %p\n",
-		       reg_order + PAGE_SHIFT - 1, num_pages, (void *)base_addr);
+		if ((pfn != 0) && (__ffs64(pfn) + 1 < reg_order)) {
+		    reg_order = __ffs64(pfn) + 1;
+		}
 
-		/* in petmem.c, we call ioctl() to send the ADD_MEMORY command, which takes us to here to initialize the buddy system. 
- 		 * page size is the minimum allocation size; pool order is (reg_order+PAGE_SHIFT-1), minimum order is PAGE_SHIFT). 
+		printk("Adding pool of order %d (%llu pages) at %p\n",
+		       reg_order + PAGE_SHIFT - 1, 1ULL << (reg_order - 1), (void *)base_addr);
+
+		/* page size is the minimum allocation size; pool order is (reg_order+PAGE_SHIFT-1), minimum order is PAGE_SHIFT).
  		 * buddy system itself doesn't have the concept of page, rather it considers the concept of bytes. thus we need to convert
  		 * from the context of pages to the context to bytes. back and forth every time buddy system is involved. */
 		tmp_pool = buddy_init(base_addr, reg_order + PAGE_SHIFT - 1, PAGE_SHIFT);
@@ -107,30 +983,35 @@ static long petmem_ioctl(struct file * filp,
 			   (void *)base_addr, reg_order);
 		    break;
 		}
-		/* and we call buddy_free right away? */
-		buddy_free(tmp_pool, (void *)base_addr, reg_order + PAGE_SHIFT - 1);
 
-		/* and we add tmp_pool->node to the global list petmem_pool_list,
+		// A pool is assumed not to straddle nodes, its first frame decides
+		tmp_pool->nid = memory_add_physaddr_to_nid(__pa(base_addr));
+		if ((tmp_pool->nid < 0) || (tmp_pool->nid >= nr_node_ids)) {
+		    tmp_pool->nid = 0;
+		}
+		/* we add tmp_pool->node to the global list petmem_pool_list,
 		 * looks like they are trying to support multiple add operations. 
 		 * in case the user sends ADD_MEMORY ioctl commands more than once. */
-		list_add(&(tmp_pool->node), &petmem_pool_list);
-
-		/* num_pages is changed here, thus the for loop will check again. it looks like even
-		 * if the user only call ioctl with a command of ADD_MEMORY once, we may still iterate multiple times
-		 * in this for loop - we keep looping as long as reg_order is not 0. this didn't make sense to me, then
-		 * I converted num_pages to binary, for example, if num_pages is 11100, then in the 1st iteration, reg_order is 4,
-		 * in the 2nd iteration, reg_order is 3, in the 3rd iteration, reg_order is 2, in the 4th iteration reg_order would finally be 0
-		 * and we get out of the loop.  */
-		num_pages -= (0x1 << (reg_order - 1));
-		/* at first this base addr is passed in by the user, who obtained the address from the hot removeable memory subsystem. 
-		 * this base_addr is just a local variable, we only use it as the 1st parameter to give to buddy_init. once again
-		 * use the above 11100 example, in the 1st iteration, we have reg_order of 4,
-		 * so we allocate 3 pages, and then move base_addr 3 pages forward to perform the next allocation, which is allocate 2 pages - because
-		 * reg_order is 3, then we move base_addr 2 pages forward and allocate 1 page, because reg_order is 2. and then we are done, because
-		 * reg_order is now 0. In such a case, after this for loop, the petmem_pool_list should have 3 more nodes added, each representing a pool of different size. */
-		base_addr += ((0x1 << (reg_order - 1)) * PAGE_SIZE);
+		if (register_pool(tmp_pool) != 0) {
+		    printk("ERROR: Too many memory pools, dropping memory at %p\n", (void *)base_addr);
+		    buddy_deinit(tmp_pool);
+		    break;
+		}
+
+		/* the pool starts out fully allocated, so make it available as one block;
+		 * this also sets up its bits in the order summary. */
+		buddy_free_all(tmp_pool);
+		num_added++;
+
+		/* e.g. for 11100b pages at an aligned base the pools get 10000b, 1000b and 100b pages,
+		 * each starting where the last one ended */
+		num_pages -= (1ULL << (reg_order - 1));
+		base_addr += ((1ULL << (reg_order - 1)) * PAGE_SIZE);
 	    }
 
+	    printk("Added %llu pages in %d pools in %lld us\n",
+		   reg.pages - num_pages, num_added, ktime_to_us(ktime_sub(ktime_get(), start)));
+
 	    break;
 	}
 
@@ -149,7 +1030,7 @@ static long petmem_ioctl(struct file * filp,
 		return -EFAULT;
 	    }
 
-	    printk("Requested allocation of %llu bytes\n", req.size);
+	    petmem_dbg("Requested allocation of %llu bytes\n", req.size);
 
 	    page_size = (req.size + (PAGE_SIZE - 1)) & (~(PAGE_SIZE - 1));
 	    num_pages = page_size >> PAGE_SHIFT;
@@ -187,6 +1068,34 @@ static long petmem_ioctl(struct file * filp,
 	    break;
 	}
 
+	case VSPACE_STATS: {
+	    struct vspace_stats stats;
+	    struct mem_map * map = filp->private_data;
+
+	    memset(&stats, 0, sizeof(struct vspace_stats));
+	    petmem_vspace_stats(map, &stats);
+
+	    if (copy_to_user(argp, &stats, sizeof(struct vspace_stats))) {
+		printk("Error copying vspace stats to user space\n");
+		return -EFAULT;
+	    }
+	    break;
+	}
+
+	case PHASE_STATS: {
+	    struct phase_stats stats;
+	    struct mem_map * map = filp->private_data;
+
+	    petmem_stats_phases(map->stats, &stats);
+	    stats.tsc_khz = tsc_khz;
+
+	    if (copy_to_user(argp, &stats, sizeof(struct phase_stats))) {
+		printk("Error copying phase stats to user space\n");
+		return -EFAULT;
+	    }
+	    break;
+	}
+
 	case PAGE_FAULT: {
 	    struct page_fault fault;
 	    struct mem_map * map = filp->private_data;
@@ -199,7 +1108,7 @@ static long petmem_ioctl(struct file * filp,
 	    }
 
 	    if (petmem_handle_pagefault(map, (uintptr_t)fault.fault_addr, (u32)fault.error_code) != 0) {
-		printk("error handling page fault for Addr:%p (error=%d)\n", (void *)fault.fault_addr, fault.error_code);
+		petmem_dbg("error handling page fault for Addr:%p (error=%d)\n", (void *)fault.fault_addr, fault.error_code);
 		return 1;
 	    }
 
@@ -209,6 +1118,108 @@ static long petmem_ioctl(struct file * filp,
 	    return 0;
 	}
 
+	case POOL_STATS: {
+	    struct pool_stats stats;
+	    struct buddy_mempool * pool = NULL;
+
+	    if (copy_from_user(&stats, argp, sizeof(struct pool_stats))) {
+		printk("Error copying pool stats request from user space\n");
+		return -EFAULT;
+	    }
+
+	    read_lock(&petmem_pool_lock);
+	    if (stats.pool_id < petmem_num_pools) {
+		pool = petmem_pools[stats.pool_id];
+	    }
+	    read_unlock(&petmem_pool_lock);
+
+	    if (pool == NULL) {
+		return -EINVAL;
+	    }
+
+	    stats.base_addr = __pa(pool->base_addr);
+	    stats.pages = 1ULL << (pool->pool_order - PAGE_SHIFT);
+	    stats.free_pages = buddy_free_bytes(pool) >> PAGE_SHIFT;
+	    stats.frag_index = buddy_frag_index(pool, COMPACT_ORDER);
+	    stats.node = pool->nid;
+
+	    if (copy_to_user(argp, &stats, sizeof(struct pool_stats))) {
+		printk("Error copying pool stats to user space\n");
+		return -EFAULT;
+	    }
+
+	    break;
+	}
+
+	case NODE_STATS: {
+	    struct node_stats stats;
+	    struct node_alloc_stats * cpu_stats = NULL;
+	    int cpu = 0;
+	    int i = 0;
+
+	    if (copy_from_user(&stats, argp, sizeof(struct node_stats))) {
+		printk("Error copying node stats request from user space\n");
+		return -EFAULT;
+	    }
+
+	    if (stats.node >= nr_node_ids) {
+		return -EINVAL;
+	    }
+
+	    stats.local_allocs = 0;
+	    stats.remote_allocs = 0;
+	    for_each_possible_cpu(cpu) {
+		if (cpu_to_node(cpu) != stats.node) {
+		    continue;
+		}
+		cpu_stats = per_cpu_ptr(&petmem_alloc_stats, cpu);
+		stats.local_allocs += READ_ONCE(cpu_stats->local);
+		stats.remote_allocs += READ_ONCE(cpu_stats->remote);
+	    }
+
+	    stats.pages = 0;
+	    stats.free_pages = 0;
+	    for (i = 0; i < READ_ONCE(petmem_num_pools); i++) {
+		if (petmem_pools[i]->nid != stats.node) {
+		    continue;
+		}
+		stats.pages += 1ULL << (petmem_pools[i]->pool_order - PAGE_SHIFT);
+		stats.free_pages += buddy_free_bytes(petmem_pools[i]) >> PAGE_SHIFT;
+	    }
+
+	    if (copy_to_user(argp, &stats, sizeof(struct node_stats))) {
+		printk("Error copying node stats to user space\n");
+		return -EFAULT;
+	    }
+
+	    break;
+	}
+
+	case COMPACT_MEMORY: {
+	    // Run a compaction pass now and wait for it
+	    mod_delayed_work(system_wq, &petmem_compact_dwork, 0);
+	    flush_delayed_work(&petmem_compact_dwork);
+	    break;
+	}
+
+	case BUDDY_BENCH: {
+	    struct buddy_bench bench;
+	    int ret = 0;
+
+	    memset(&bench, 0, sizeof(struct buddy_bench));
+
+	    ret = buddy_bench_run(&bench);
+	    if (ret != 0) {
+		return ret;
+	    }
+
+	    if (copy_to_user(argp, &bench, sizeof(struct buddy_bench))) {
+		printk("Error copying allocator benchmark to user space\n");
+		return -EFAULT;
+	    }
+	    break;
+	}
+
 	case INVALIDATE_PAGE: {
 	    uintptr_t addr = (uintptr_t)arg;
 	    invlpg(PAGE_ADDR(addr));
@@ -235,9 +1246,13 @@ static long petmem_ioctl(struct file * filp,
 static int petmem_open(struct inode * inode, struct file * filp) {
 
 
-    printk(KERN_INFO "openning /dev/petmem...\n");
+    petmem_dbg("openning /dev/petmem...\n");
     filp->private_data = petmem_init_process();
 
+    if (filp->private_data == NULL) {
+	return -ENOMEM;
+    }
+
     return 0;
 }
 
@@ -251,7 +1266,7 @@ static int petmem_open(struct inode * inode, struct file * filp) {
 static int petmem_release(struct inode * inode, struct file * filp) {
     struct mem_map * map = filp->private_data;
 
-    printk(KERN_INFO "closing /dev/petmem...\n");
+    petmem_dbg("closing /dev/petmem...\n");
     // garbage collect
     petmem_deinit_process(map);
 
@@ -269,9 +1284,53 @@ static struct file_operations ctrl_fops = {
 
 
 
+/* Builds petmem_node_fallback: every row is the node ids sorted by distance from that row's node.
+ * The per-node pool summary is sized by nr_node_ids as well, so it is allocated here too. */
+static int petmem_init_node_fallback(void) {
+    int * row = NULL;
+    int nid = 0;
+    int i = 0;
+    int j = 0;
+    int tmp = 0;
+
+    pools_with_order = kcalloc(nr_node_ids, sizeof(*pools_with_order), GFP_KERNEL);
+    petmem_node_fallback = kmalloc(nr_node_ids * nr_node_ids * sizeof(int), GFP_KERNEL);
+    if ((pools_with_order == NULL) || (petmem_node_fallback == NULL)) {
+	kfree(pools_with_order);
+	kfree(petmem_node_fallback);
+	return -1;
+    }
+
+    for (nid = 0; nid < nr_node_ids; nid++) {
+	row = petmem_node_fallback + (nid * nr_node_ids);
+
+	for (i = 0; i < nr_node_ids; i++) {
+	    row[i] = i;
+	}
+
+	// Insertion sort, a node is always at distance 0 from itself and sorts first
+	for (i = 1; i < nr_node_ids; i++) {
+	    tmp = row[i];
+	    for (j = i; (j > 0) && (node_distance(nid, row[j - 1]) > node_distance(nid, tmp)); j--) {
+		row[j] = row[j - 1];
+	    }
+	    row[j] = tmp;
+	}
+    }
+
+    return 0;
+}
+
+static void petmem_exit_node_fallback(void) {
+    kfree(petmem_node_fallback);
+    kfree(pools_with_order);
+}
+
+
 static int __init petmem_init(void) {
     dev_t dev = MKDEV(0, 0);
     int ret = 0;
+    int cpu = 0;
 
     printk("-------------------------\n");
     printk("-------------------------\n");
@@ -279,11 +1338,41 @@ static int __init petmem_init(void) {
     printk("-------------------------\n");
     printk("-------------------------\n");
 
+    for_each_possible_cpu(cpu) {
+	spin_lock_init(&(per_cpu_ptr(&petmem_frame_caches, cpu)->lock));
+    }
+
+    petmem_stats_init();
+
+    if (petmem_init_node_fallback() != 0) {
+	printk("Failed to allocate the NUMA fallback table\n");
+	petmem_stats_exit();
+	return -ENOMEM;
+    }
+
+    if (petmem_workqueues_init() != 0) {
+	printk("Failed to create the workqueues\n");
+	petmem_exit_node_fallback();
+	petmem_stats_exit();
+	return -ENOMEM;
+    }
+
+    if (petmem_zero_pools_init() != 0) {
+	printk("Failed to start the page zeroing thread\n");
+	petmem_workqueues_exit();
+	petmem_exit_node_fallback();
+	petmem_stats_exit();
+	return -ENOMEM;
+    }
 
     petmem_class = class_create(THIS_MODULE, "petmem");
 
     if (IS_ERR(petmem_class)) {
 	printk("Failed to register Pet Memory class\n");
+	petmem_zero_pools_exit();
+	petmem_workqueues_exit();
+	petmem_exit_node_fallback();
+	petmem_stats_exit();
 	return PTR_ERR(petmem_class);
     }
 
@@ -292,6 +1381,10 @@ static int __init petmem_init(void) {
     if (ret < 0) {
 	printk("Error Registering memory controller device\n");
 	class_destroy(petmem_class);
+	petmem_zero_pools_exit();
+	petmem_workqueues_exit();
+	petmem_exit_node_fallback();
+	petmem_stats_exit();
 	return ret;
     }
 
@@ -307,6 +1400,8 @@ static int __init petmem_init(void) {
 
     device_create(petmem_class, NULL, dev, NULL, "petmem");
 
+    schedule_delayed_work(&petmem_compact_dwork, COMPACT_INTERVAL);
+
     return 0;
 }
 
@@ -315,6 +1410,8 @@ static void __exit petmem_exit(void) {
     dev_t dev = 0;
 
     printk("Unloading Pet Memory manager\n");
+    cancel_delayed_work_sync(&petmem_compact_dwork);
+
     dev = MKDEV(major_num, 0);
 
     unregister_chrdev_region(MKDEV(major_num, 0), 1);
@@ -323,6 +1420,14 @@ static void __exit petmem_exit(void) {
 
     class_destroy(petmem_class);
 
+    /* Processes that closed the device may still be tearing down */
+    petmem_workqueues_exit();
+
+    petmem_zero_pools_exit();
+
+    petmem_exit_node_fallback();
+
+    petmem_stats_exit();
 
     // deinit buddy pools
     //    list_for_each_entry_safe(...)
@@ -4,11 +4,17 @@
 
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/sched.h>
+#include <linux/sched/mm.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 
 #include "petmem.h"
 #include "pgtables.h"
 #include "on_demand.h"
 #include "swap.h"
+#include "petmem_trace.h"
 
 #define PHYSICAL_OFFSET(x) (((u64)x) & 0xfff)
 #define PAGE_SIZE_BYTES 4096
@@ -17,15 +23,435 @@
 #define ERROR_PERMISSION 2
 #define NOT_VALID_RANGE 1
 #define ALLOCATED_ADDRESS_RANGE 2
-#define DEBUG 1
 #define CLOCK_POLICY "clock"
 #define FIFO_POLICY "fifo"
 
+/* Bit positions in a 64 bit entry, for atomic updates of entries the MMU may be writing */
+#define PTE_PRESENT_BIT  0
+#define PTE_ACCESSED_BIT 5
+#define PTE_DIRTY_BIT    6
+#define PTE_WORD(pte) ((unsigned long *)(pte))
+/* vmm_info read fresh from memory, for loops that wait on another thread (bitfields cannot be READ_ONCE'd) */
+#define PTE_VMM_INFO(pte) ((READ_ONCE(*PTE_WORD(pte)) >> 9) & 0x7)
+
+/* How many times a fault evicts a page and retries before giving up on getting a frame */
+#define EVICT_RETRIES 8
+
+/* Regions of at least this many pages are 2 MB aligned and mapped with large pages where possible */
+#define HUGE_PAGE_PAGES 512
+#define HUGE_PAGE_SIZE  (1UL << PAGE_POWER_2MB)
+
+/* Fault-around window bounds, in pages. It never reaches 0, so a process that turns
+ * sequential again is noticed. */
+#define FAULT_AROUND_MIN  1
+#define FAULT_AROUND_INIT 8
+#define FAULT_AROUND_MAX  64
+
+/* At most this many of a window's frames come from the node's zero pool, which has
+ * ZERO_POOL_HIGH frames; the rest of the window is zeroed here, so demand
+ * faults on other CPUs of the node still find pre-zeroed frames. */
+#define FAULT_AROUND_ZEROED 16
+
+/* Stride prefetch: a stream is confirmed once the same distance between swap-in
+ * faults repeats, and each further repeat doubles how far ahead is read */
+#define PREFETCH_DEPTH       4
+#define PREFETCH_MAX         16
+#define PREFETCH_MAX_PENDING 4  /* queued requests per process */
+
+/* Every open instance, so compaction can find the PTE behind a frame's owner */
+static LIST_HEAD(petmem_maps);
+static DEFINE_MUTEX(petmem_maps_mutex);
+
+static void populate_upper_tables(struct mem_map * map, uintptr_t start, uintptr_t end);
+
+/* Page table pages held in petmem pools, by every process */
+static atomic_long_t petmem_table_pages = ATOMIC_LONG_INIT(0);
+
+/* A prefetched page counts as a hit the first time it is seen accessed: when the clock
+ * clears its accessed bit, or when it is evicted or unmapped. Called with pt_lock held,
+ * or vspace_sem held for write. */
+static inline void prefetch_account(struct mem_map * map, struct vp_node * node) {
+    if (node->prefetched && ((pte64_t *)node->pte)->accessed) {
+        map->prefetch_hits++;
+        petmem_count(map->stats, PETMEM_PREFETCH_HIT);
+    }
+    node->prefetched = 0;
+}
+
+
+/* Swap I/O of a process, counted and timed for its statistics. phase is the fault
+ * phase it belongs to, or PHASE_BACKGROUND_IO when no fault is waiting for it. */
+static int map_swap_read(struct mem_map * map, u32 index, void * dst_page, int phase) {
+    u64 tsc = rdtsc_ordered();
+    u64 start = ktime_get_ns();
+    int ret = swap_read_page(map->swap, index, dst_page);
+
+    petmem_record_latency(map->stats, PETMEM_LAT_SWAP_IO, ktime_get_ns() - start);
+    petmem_phase_end(map->stats, phase, tsc);
+    petmem_count(map->stats, PETMEM_SWAP_READ);
+    return ret;
+}
+
+static int map_swap_write(struct mem_map * map, u32 index, void * page, int phase) {
+    u64 tsc = rdtsc_ordered();
+    u64 start = ktime_get_ns();
+    int ret = swap_write_page(map->swap, index, page);
+
+    petmem_record_latency(map->stats, PETMEM_LAT_SWAP_IO, ktime_get_ns() - start);
+    petmem_phase_end(map->stats, phase, tsc);
+    petmem_count(map->stats, PETMEM_SWAP_WRITE);
+    return ret;
+}
+
+
+/* Region index. All regions, allocated or not, tile the petmem range and sit in
+ * map->regions in address order, so neighbours for coalescing are rb_prev/rb_next.
+ * FREE regions are also in map->free_regions ordered by (size, address), so the
+ * leftmost region that is large enough is the best fit. Callers hold vspace_sem. */
+static void region_insert(struct mem_map * map, struct vaddr_reg * reg) {
+    struct rb_node ** link = &(map->regions.rb_node);
+    struct rb_node * parent = NULL;
+    struct vaddr_reg * cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct vaddr_reg, addr_node);
+        if (reg->page_addr < cur->page_addr) {
+            link = &(parent->rb_left);
+        } else {
+            link = &(parent->rb_right);
+        }
+    }
+    rb_link_node(&(reg->addr_node), parent, link);
+    rb_insert_color(&(reg->addr_node), &(map->regions));
+}
+
+static void free_region_insert(struct mem_map * map, struct vaddr_reg * reg) {
+    struct rb_node ** link = &(map->free_regions.rb_node);
+    struct rb_node * parent = NULL;
+    struct vaddr_reg * cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct vaddr_reg, size_node);
+        if (reg->size < cur->size || (reg->size == cur->size && reg->page_addr < cur->page_addr)) {
+            link = &(parent->rb_left);
+        } else {
+            link = &(parent->rb_right);
+        }
+    }
+    rb_link_node(&(reg->size_node), parent, link);
+    rb_insert_color(&(reg->size_node), &(map->free_regions));
+}
+
+/* The region containing address, allocated or not, or NULL outside the petmem range */
+static struct vaddr_reg * region_lookup(struct mem_map * map, uintptr_t address) {
+    struct rb_node * node = map->regions.rb_node;
+    struct vaddr_reg * cur;
+
+    while (node) {
+        cur = rb_entry(node, struct vaddr_reg, addr_node);
+        if (address < cur->page_addr) {
+            node = node->rb_left;
+        } else if (address >= cur->page_addr + (cur->size << PAGE_POWER_4KB)) {
+            node = node->rb_right;
+        } else {
+            return cur;
+        }
+    }
+    return NULL;
+}
+
+/* Called on every fault with vspace_sem held for read, so the trees cannot change under us.
+ * Faults mostly hit the same region as the last one, which is tried first.
+ * Returns the allocated region holding address, or NULL. */
+static struct vaddr_reg * fault_region(struct mem_map * map, uintptr_t address){
+ 	struct vaddr_reg * cur;
+
+	cur = READ_ONCE(map->last_hit);
+	if(cur != NULL && address >= cur->page_addr && address < (cur->page_addr + 4096 * cur->size)){
+		return cur;
+	}
+
+	cur = region_lookup(map, address);
+	if(cur != NULL && cur->status == ALLOCATED){
+		WRITE_ONCE(map->last_hit, cur);
+		return cur;
+	}
+    return NULL;
+
+}
+
+/* The smallest FREE region of at least size pages, the lowest one among equals */
+static struct vaddr_reg * region_best_fit(struct mem_map * map, u64 size) {
+    struct rb_node * node = map->free_regions.rb_node;
+    struct vaddr_reg * cur;
+    struct vaddr_reg * best = NULL;
+
+    while (node) {
+        cur = rb_entry(node, struct vaddr_reg, size_node);
+        if (cur->size >= size) {
+            best = cur;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return best;
+}
+
+
+/* Range unmap. The tables are walked once over [start, end), top down. Everything
+ * released on the way, data frames and emptied table pages, is only handed back
+ * after the TLB flush that covers it, so no CPU can still be using a freed frame.
+ * Swap slots, both of swapped out pages and the kept copies of resident ones, are
+ * released as they are found. Called with vspace_sem held for write, which keeps
+ * faults, eviction and compaction away from this process. */
+#define UNMAP_BATCH_MAX 64
+
+struct unmap_batch {
+    struct tlb_batch tlb;
+    uintptr_t frames[UNMAP_BATCH_MAX]; /* physical addresses of data frames */
+    unsigned int nr_frames;
+    uintptr_t tables[UNMAP_BATCH_MAX]; /* physical addresses of table pages */
+    unsigned int nr_tables;
+    uintptr_t huge[UNMAP_BATCH_MAX];   /* physical addresses of 2 MB frames */
+    unsigned int nr_huge;
+};
+
+static void unmap_batch_flush(struct mem_map * map, struct unmap_batch * ub) {
+    unsigned int i;
+
+    tlb_batch_flush(&(ub->tlb));
+
+    for (i = 0; i < ub->nr_huge; i++) {
+        petmem_free_pages(ub->huge[i], HUGE_PAGE_PAGES);
+    }
+
+    petmem_free_pages_bulk(ub->frames, ub->nr_frames);
+    petmem_free_pages_bulk(ub->tables, ub->nr_tables);
+    map->table_pages -= ub->nr_tables;
+    atomic_long_sub(ub->nr_tables, &petmem_table_pages);
+
+    ub->nr_frames = 0;
+    ub->nr_tables = 0;
+    ub->nr_huge = 0;
+    tlb_batch_init(&(ub->tlb), map->mm);
+}
+
+static void unmap_pte(struct mem_map * map, pte64_t * pte, uintptr_t vaddr, struct unmap_batch * ub) {
+    struct vp_node * node;
+    uintptr_t frame;
+
+    if (pte->present) {
+        frame = BASE_TO_PAGE_ADDR(pte->page_base_addr);
+        if (petmem_frame_owner(frame, (void **)&node) == map) {
+            list_del(&(node->list));
+            prefetch_account(map, node);
+            if (node->swap_valid) {
+                free_block(map->swap, node->swap_index);
+            }
+            kfree(node);
+        }
+        petmem_set_frame_owner(frame, NULL, NULL);
+
+        tlb_batch_add(&(ub->tlb), vaddr);
+        ub->frames[ub->nr_frames++] = frame;
+    } else if (PTE_IS_SWAPPED(pte)) {
+        free_block(map->swap, pte->page_base_addr);
+    }
+    *(u64 *)pte = 0;
+
+    if (ub->nr_frames == UNMAP_BATCH_MAX) {
+        unmap_batch_flush(map, ub);
+    }
+}
+
+/* A large PDE is only ever installed over 2 MB that lie inside one region, and regions
+ * are unmapped whole, so it is always unmapped whole too */
+static void unmap_huge(struct mem_map * map, pte64_t * pde, uintptr_t vaddr, struct unmap_batch * ub) {
+    uintptr_t frame = BASE_TO_PAGE_ADDR(pde->page_base_addr);
+    struct vp_node * node;
+
+    if (petmem_frame_owner(frame, (void **)&node) == map) {
+        list_del(&(node->list));
+        kfree(node);
+    }
+    petmem_set_frame_owner(frame, NULL, NULL);
+
+    tlb_batch_add(&(ub->tlb), vaddr);
+    ub->huge[ub->nr_huge++] = frame;
+    *(u64 *)pde = 0;
+
+    if (ub->nr_huge == UNMAP_BATCH_MAX) {
+        unmap_batch_flush(map, ub);
+    }
+}
+
+/* Only tables that map nothing but the petmem range are ours, and come from the
+ * petmem pools. The ones above them (the PDP under PML4 entry 0) are shared with
+ * the rest of the process and belong to the kernel. */
+static inline int table_in_region(uintptr_t addr, int shift) {
+    uintptr_t base = addr & ~((1UL << shift) - 1);
+
+    return (base >= PETMEM_REGION_START) && (base + (1UL << shift) <= PETMEM_REGION_END);
+}
+
+static int unmap_level(struct mem_map * map, pte64_t * table, int level,
+                       uintptr_t start, uintptr_t end, struct unmap_batch * ub);
+
+/* A swapped out table only references swap slots, so it is read into a bounce
+ * buffer to release them rather than brought back into a frame */
+static void unmap_swapped_table(struct mem_map * map, pte64_t * entry, int level,
+                                uintptr_t start, uintptr_t end, struct unmap_batch * ub) {
+    u32 index = entry->page_base_addr;
+    pte64_t * buf;
+
+    buf = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    if (buf == NULL || map_swap_read(map, index, buf, PHASE_BACKGROUND_IO) != 0) {
+        printk(KERN_ERR "Could not read swapped table, its swap slots are lost\n");
+        kfree(buf);
+        return;
+    }
+
+    if (unmap_level(map, buf, level, start, end, ub)) {
+        free_block(map->swap, index);
+        *(u64 *)entry = 0;
+    } else {
+        map_swap_write(map, index, buf, PHASE_BACKGROUND_IO);
+    }
+    kfree(buf);
+}
+
+/* Unmaps [start, end) below one table; level 0 is a page table, 3 the PML4.
+ * Returns 1 if the table is left with no entries at all. */
+static int unmap_level(struct mem_map * map, pte64_t * table, int level,
+                       uintptr_t start, uintptr_t end, struct unmap_batch * ub) {
+    int shift = PAGE_SHIFT + (9 * level);
+    uintptr_t span = 1UL << (shift + 9);
+    uintptr_t addr, next;
+    pte64_t * entry;
+    pte64_t * child;
+    int i;
+
+    for (addr = start; addr < end; addr = next) {
+        next = min(((addr >> shift) + 1) << shift, end);
+        entry = &table[(addr >> shift) & 0x1ff];
+
+        if (level == 0) {
+            unmap_pte(map, entry, addr, ub);
+            continue;
+        }
+        if (!entry->present) {
+            if (PTE_IS_SWAPPED(entry)) {
+                unmap_swapped_table(map, entry, level - 1, addr, next, ub);
+            }
+            continue;
+        }
+        if (level == 1 && ((pde64_t *)entry)->large_page) {
+            unmap_huge(map, entry, addr, ub);
+            continue;
+        }
+
+        child = (pte64_t *)__va(BASE_TO_PAGE_ADDR(entry->page_base_addr));
+        if (unmap_level(map, child, level - 1, addr, next, ub) && table_in_region(addr, shift)) {
+            *(u64 *)entry = 0;
+            /* Paging structure caches may still point at it, only a full flush drops them */
+            tlb_batch_add_table(&(ub->tlb));
+            ub->tables[ub->nr_tables++] = __pa(child);
+            if (ub->nr_tables == UNMAP_BATCH_MAX) {
+                unmap_batch_flush(map, ub);
+            }
+        }
+    }
+
+    /* A table whose whole span was unmapped is empty without looking */
+    if (((start & (span - 1)) == 0) && (end - start == span)) {
+        return 1;
+    }
+    /* Otherwise one scan per table, not one per page. Swapped entries are not present but still in use. */
+    for (i = 0; i < 512; i++) {
+        if (*(u64 *)&table[i] != 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static void unmap_range(struct mem_map * map, uintptr_t start, uintptr_t end) {
+    struct unmap_batch ub;
+
+    ub.nr_frames = 0;
+    ub.nr_tables = 0;
+    ub.nr_huge = 0;
+    tlb_batch_init(&(ub.tlb), map->mm);
+
+    /* Tables may be freed below, no fault can run while we hold vspace_sem for write */
+    write_seqlock(&(map->walk_lock));
+    memset(&(map->walk), 0, sizeof(struct walk_cache));
+    write_sequnlock(&(map->walk_lock));
+    map->fa.ptes = NULL;
+
+    /* The PML4 itself belongs to the process and is never freed */
+    unmap_level(map, (pte64_t *)map->mm->pgd, 3, start, end, &ub);
+
+    unmap_batch_flush(map, &ub);
+}
+
+
+// de-initialize the whole address space.
+/* Teardown runs here so close() does not wait for it, see petmem_mm_release() for exit */
+static struct workqueue_struct * petmem_teardown_wq;
+/* Swap-in prefetch, see prefetch_predict() */
+static struct workqueue_struct * petmem_prefetch_wq;
+
+/* Unmapping takes every resident page off the list, anything left is a bug. Its frame
+ * stops pointing at the node and is leaked, rather than freed while it may be mapped. */
+static void drop_stray_nodes(struct mem_map * map) {
+    struct vp_node * node, * next;
+    uintptr_t frame;
+    void * data;
+
+    list_for_each_entry_safe(node, next, &(map->clock_hand), list) {
+        WARN_ONCE(1, "petmem: page at %p still listed after unmap\n", (void *)node->vaddr);
+        if (node->huge) {
+            frame = BASE_TO_PAGE_ADDR_2MB(((pde64_2MB_t *)node->pte)->page_base_addr);
+        } else {
+            frame = BASE_TO_PAGE_ADDR(((pte64_t *)node->pte)->page_base_addr);
+        }
+        if (petmem_frame_owner(frame, &data) == map && data == node) {
+            petmem_set_frame_owner(frame, NULL, NULL);
+        }
+        list_del(&(node->list));
+        kfree(node);
+    }
+}
+
+/* Empties the petmem range: frames, table pages and swap slots all go back. Called by
+ * exit_mmap() before it frees the PDP our tables hang off, or by
+ * mmu_notifier_unregister() at teardown if the device was closed first. Runs once. */
+static void petmem_mm_release(struct mmu_notifier * mn, struct mm_struct * mm) {
+    struct mem_map * map = container_of(mn, struct mem_map, mn);
+
+    /* No fault can queue more once the mm is going, wait for the ones in flight */
+    flush_workqueue(petmem_prefetch_wq);
+
+    down_write(&(map->vspace_sem));
+    /* One walk over the whole petmem range, it only descends into tables that are present */
+    unmap_range(map, PETMEM_REGION_START, PETMEM_REGION_END);
+    drop_stray_nodes(map);
+    map->mm_gone = 1;
+    up_write(&(map->vspace_sem));
+}
+
+static const struct mmu_notifier_ops petmem_mmu_notifier_ops = {
+    .release = petmem_mm_release,
+};
 
 
 /* when user testing program opens /dev/petmem, this function gets called by petmem_open(),
- * which initializes a list head represented by new_proc->memory_allocations,
- * and adds it to the list first_node->list. 
+ * which initializes the region trees of new_proc,
+ * and adds first_node, one free region covering everything, to them. 
  * but both new_proc and first_node are local pointers. 
  * in order to access these two later, here we return new_proc and in petmem_open(),
  * this return value is assigned to flip->private_data, so
@@ -36,71 +462,707 @@ struct mem_map * petmem_init_process(void) {
 	struct mem_map * new_proc;
 	struct vaddr_reg * first_node = (struct vaddr_reg *) kmalloc(sizeof(struct vaddr_reg), GFP_KERNEL);
 	struct swap_space * swaps = swap_init();
-    printk(KERN_INFO "process initialization...\n");
+    petmem_dbg("process initialization...\n");
 	new_proc = (struct mem_map *)kmalloc(sizeof(struct mem_map), GFP_KERNEL);
-	INIT_LIST_HEAD(&(new_proc->memory_allocations));  // Makes circular list. Sets next and prev by itself
+	if (new_proc != NULL) {
+		new_proc->stats = petmem_stats_alloc();
+	}
+	if (new_proc == NULL || new_proc->stats == NULL || first_node == NULL || swaps == NULL) {
+		if (new_proc != NULL) {
+			petmem_stats_free(new_proc->stats);
+		}
+		kfree(new_proc);
+		kfree(first_node);
+		if (swaps != NULL) {
+			swap_free(swaps);
+		}
+		return NULL;
+	}
+	new_proc->regions = RB_ROOT;
+	new_proc->free_regions = RB_ROOT;
+	new_proc->last_hit = NULL;
+	new_proc->table_pages = 0;
+	new_proc->fa.ptes = NULL;
+	new_proc->fa.nr = 0;
+	new_proc->fa.window = FAULT_AROUND_INIT;
+	new_proc->swapin_faults = 0;
+	new_proc->prefetch_issued = 0;
+	new_proc->prefetch_hits = 0;
+	atomic_set(&(new_proc->prefetch_pending), 0);
+	seqlock_init(&(new_proc->walk_lock));
+	memset(&(new_proc->walk), 0, sizeof(struct walk_cache));
     INIT_LIST_HEAD(&(new_proc->clock_hand));
     new_proc->policy_name = FIFO_POLICY;
+    /* Pinned for mmu_notifier_unregister() at close(), which may come after the process exited */
+    new_proc->mm = current->mm;
+    mmgrab(new_proc->mm);
+    init_rwsem(&(new_proc->vspace_sem));
+    spin_lock_init(&(new_proc->pt_lock));
+    init_waitqueue_head(&(new_proc->io_wait));
+
+    new_proc->mm_gone = 0;
+    memset(&(new_proc->mn), 0, sizeof(struct mmu_notifier));
+    new_proc->mn.ops = &petmem_mmu_notifier_ops;
+    if (mmu_notifier_register(&(new_proc->mn), new_proc->mm) != 0) {
+        mmdrop(new_proc->mm);
+        petmem_stats_free(new_proc->stats);
+        kfree(new_proc);
+        kfree(first_node);
+        swap_free(swaps);
+        return NULL;
+    }
 
 	first_node->status = FREE;
 	first_node->size = ((PETMEM_REGION_END - PETMEM_REGION_START) >> PAGE_POWER_4KB); // No of pages
 	first_node->page_addr = PETMEM_REGION_START;
 
-	INIT_LIST_HEAD(&(first_node->list));
     new_proc->swap = swaps;
-	list_add(&(first_node->list), &(new_proc->memory_allocations));
-    // void list_add(struct list_head *new, struct list_head *head); add a new entry just after the head node.
-    // It works as stack. New node is placed just after the head node.
-    // new_proc->clock_hand = new_proc->memory_allocations = first_node->list
+	region_insert(new_proc, first_node);
+	free_region_insert(new_proc, first_node);
+
+    new_proc->stats_file = petmem_stats_add_process(new_proc->stats, current->tgid);
+
+    mutex_lock(&petmem_maps_mutex);
+    list_add(&(new_proc->maps), &petmem_maps);
+    mutex_unlock(&petmem_maps_mutex);
     // filp->private_data = new_proc
     return new_proc;
 
 }
 
-// de-initialize the whole address space.
+/* The frames, tables and swap slots went back in petmem_mm_release(), what is left
+ * here is our own bookkeeping */
+static void petmem_teardown_work(struct work_struct * work) {
+    struct mem_map * map = container_of(work, struct mem_map, teardown);
+	struct vaddr_reg * entry, * tmp;
+
+    /* Runs the release if the process is still alive, else waits for exit_mmap()'s to finish */
+    mmu_notifier_unregister(&(map->mn), map->mm);
+
+    down_write(&(map->vspace_sem));
+    rbtree_postorder_for_each_entry_safe(entry, tmp, &(map->regions), addr_node) {
+		kfree(entry);
+	}
+	map->regions = RB_ROOT;
+	map->free_regions = RB_ROOT;
+	map->last_hit = NULL;
+    up_write(&(map->vspace_sem));
+
+    //Frees up the swap space
+    swap_free(map->swap);
+    mmdrop(map->mm);
+    petmem_stats_free(map->stats);
+	kfree(map);
+}
+
 void petmem_deinit_process(struct mem_map * map) {  // map gets the filp->private_data
-	struct list_head * pos, * next;
-	struct vaddr_reg *entry;
-    struct vp_node *node;
+    mutex_lock(&petmem_maps_mutex);
+    list_del(&(map->maps));
+    mutex_unlock(&petmem_maps_mutex);
+
+    /* Nobody reads the counters after this, the teardown is left to free them */
+    petmem_stats_remove_process(map->stats_file);
+
+    /* Out of the process list, so compaction can no longer find it */
+    INIT_WORK(&(map->teardown), petmem_teardown_work);
+    queue_work(petmem_teardown_wq, &(map->teardown));
+}
+
+int petmem_workqueues_init(void) {
+    petmem_teardown_wq = alloc_workqueue("petmem_teardown", WQ_UNBOUND, 0);
+    if (petmem_teardown_wq == NULL) {
+        return -1;
+    }
+    petmem_prefetch_wq = alloc_workqueue("petmem_prefetch", WQ_UNBOUND, 0);
+    if (petmem_prefetch_wq == NULL) {
+        destroy_workqueue(petmem_teardown_wq);
+        return -1;
+    }
+    return 0;
+}
+
+/* Waits for every pending teardown, and the prefetches they wait for */
+void petmem_workqueues_exit(void) {
+    destroy_workqueue(petmem_teardown_wq);
+    destroy_workqueue(petmem_prefetch_wq);
+}
+
+/* called by petmem_ioctl() in case of LAZY_ALLOC. */
+uintptr_t petmem_alloc_vspace(struct mem_map * map, u64 num_pages) { // Only for allocating virtual memory
+    uintptr_t addr;
+
+    petmem_dbg("Memory allocation\n");
+    down_write(&(map->vspace_sem));
+    addr = allocate(map, num_pages);
+    if (addr != 0) {
+        populate_upper_tables(map, addr, addr + (num_pages << PAGE_POWER_4KB));
+    }
+    up_write(&(map->vspace_sem));
+    return addr;
+}
+
+void petmem_dump_vspace(struct mem_map * map) {
+    printk("Page table pages: %lu (all processes: %ld)\n", map->table_pages, atomic_long_read(&petmem_table_pages));
+    petmem_stats_dump(map->stats);
+}
+
+void petmem_vspace_stats(struct mem_map * map, struct vspace_stats * stats) {
+    down_read(&(map->vspace_sem));
+    stats->table_pages = map->table_pages;
+    spin_lock(&(map->pt_lock));
+    stats->swapin_faults = map->swapin_faults;
+    stats->prefetch_issued = map->prefetch_issued;
+    stats->prefetch_hits = map->prefetch_hits;
+    spin_unlock(&(map->pt_lock));
+    up_read(&(map->vspace_sem));
+    stats->table_pages_total = atomic_long_read(&petmem_table_pages);
+}
+
+// Only the PML needs to stay, everything else can be freed
+void petmem_free_vspace(struct mem_map * map, uintptr_t vaddr) {
+    petmem_dbg("Free memory\n");
+    down_write(&(map->vspace_sem));
+	free_address(map, vaddr);
+    up_write(&(map->vspace_sem));
+    return;
+
+}
+
+static struct vp_node * new_vp_node(pte64_t * pte, uintptr_t vaddr) {
+    struct vp_node * new_node;
+
+    new_node = (struct vp_node *)kmalloc(sizeof(struct vp_node), GFP_KERNEL);
+    if (new_node == NULL) {
+        return NULL;
+    }
+    new_node->pte = pte;
+    new_node->vaddr = vaddr;
+    new_node->swap_index = 0;
+    new_node->swap_valid = 0;
+    new_node->huge = 0;
+    new_node->prefetched = 0;
+    INIT_LIST_HEAD(&(new_node->list));
+    return new_node;
+}
+
+/* Gets a free frame, evicting pages of this process until one turns up, and only
+ * then pulling in frames cached on other CPUs. The cycles spent in the allocator
+ * itself are added to *cycles; evictions are timed as phases of their own.
+ * Called with no locks held except vspace_sem for read. */
+static uintptr_t __alloc_frame(struct mem_map * map, u64 * cycles) {
+    uintptr_t memory = 0;
+    u64 tsc;
+    int tries;
+
+    for (tries = 0; tries < EVICT_RETRIES; tries++) {
+        tsc = rdtsc_ordered();
+        memory = petmem_alloc_pages(1);
+        *cycles += rdtsc_ordered() - tsc;
+        if (memory != 0) {
+            return memory;
+        }
+        /* The frame we free may be taken by another thread before we get it, so loop */
+        if (clear_up_memory(map) != 0) {
+            break;
+        }
+    }
+    if (petmem_drain_cached_frames() != 0) {
+        tsc = rdtsc_ordered();
+        memory = petmem_alloc_pages(1);
+        *cycles += rdtsc_ordered() - tsc;
+    }
+    return memory;
+}
+
+static uintptr_t alloc_frame(struct mem_map * map) {
+    u64 cycles = 0;
+    uintptr_t memory = __alloc_frame(map, &cycles);
+
+    petmem_phase_add(map->stats, PHASE_FRAME_ALLOC, cycles);
+    return memory;
+}
+
+/* A zeroed frame from the pre-zeroed pool, or from free memory zeroed here. Never
+ * evicts, returns 0 when neither has a frame. */
+static uintptr_t try_alloc_zeroed_frame(void) {
+    uintptr_t memory;
+
+    if (petmem_alloc_zeroed_pages(&memory, 1) == 1) {
+        return memory;
+    }
+    memory = petmem_alloc_pages(1);
+    if (memory != 0) {
+        memset(__va(memory), 0, PAGE_SIZE);
+    }
+    return memory;
+}
+
+/* Like alloc_frame(), but the frame comes zeroed: from the pre-zeroed pool while it
+ * lasts, zeroed here otherwise. */
+static uintptr_t alloc_zeroed_frame(struct mem_map * map) {
+    u64 tsc = rdtsc_ordered();
+    u64 cycles = 0;
+    uintptr_t memory;
+
+    memory = try_alloc_zeroed_frame();
+    cycles = rdtsc_ordered() - tsc;
+    if (memory == 0) {
+        memory = __alloc_frame(map, &cycles);
+        if (memory != 0) {
+            tsc = rdtsc_ordered();
+            memset(__va(memory), 0, PAGE_SIZE);
+            cycles += rdtsc_ordered() - tsc;
+        }
+    }
+    petmem_phase_add(map->stats, PHASE_FRAME_ALLOC, cycles);
+    return memory;
+}
+
+/* Maps up to fa.window empty pages following the compulsory fault at pte, in the same
+ * page table and region. Frames come from one bulk allocation and only from free
+ * memory: nothing is evicted for pages that may never be used. */
+static void fault_around(struct mem_map * map, struct vaddr_reg * reg, pte64_t * pte, uintptr_t vaddr) {
+    uintptr_t frames[FAULT_AROUND_MAX];
+    struct vp_node * nodes[FAULT_AROUND_MAX];
+    uintptr_t reg_end = reg->page_addr + (reg->size << PAGE_POWER_4KB);
+    unsigned long nr, got, zeroed;
+    unsigned int used = 0;
+    unsigned int i;
+    u64 tsc;
+
+    spin_lock(&(map->pt_lock));
+    if (map->fa.ptes != NULL) {
+        for (i = 0; i < map->fa.nr; i++) {
+            if (map->fa.ptes[i].present && map->fa.ptes[i].accessed) {
+                used++;
+            }
+        }
+        if (used * 4 >= map->fa.nr * 3) {
+            map->fa.window = min(map->fa.window * 2, (unsigned int)FAULT_AROUND_MAX);
+        } else if (used * 4 < map->fa.nr) {
+            map->fa.window = max(map->fa.window / 2, (unsigned int)FAULT_AROUND_MIN);
+        }
+        map->fa.ptes = NULL;
+    }
+    nr = map->fa.window;
+    spin_unlock(&(map->pt_lock));
+
+    nr = min(nr, 511 - (unsigned long)PTE64_INDEX(vaddr));
+    nr = min(nr, ((reg_end - vaddr) >> PAGE_POWER_4KB) - 1);
+    /* Only the run of never touched pages right after the fault */
+    for (i = 0; i < nr; i++) {
+        if (*(u64 *)&pte[i + 1] != 0) {
+            break;
+        }
+    }
+    nr = i;
+    if (nr == 0) {
+        return;
+    }
+
+    tsc = rdtsc_ordered();
+    zeroed = petmem_alloc_zeroed_pages(frames, min(nr, (unsigned long)FAULT_AROUND_ZEROED));
+    got = zeroed + petmem_alloc_pages_bulk(frames + zeroed, nr - zeroed);
+    for (i = 0; i < got; i++) {
+        nodes[i] = new_vp_node(&pte[i + 1], vaddr + ((uintptr_t)(i + 1) << PAGE_POWER_4KB));
+        if (nodes[i] == NULL) {
+            break;
+        }
+        if (i >= zeroed) {
+            memset(__va(frames[i]), 0, PAGE_SIZE);
+        }
+    }
+    petmem_phase_end(map->stats, PHASE_FRAME_ALLOC, tsc);
+    nr = i;
+
+    spin_lock(&(map->pt_lock));
+    for (i = 0; i < nr; i++) {
+        if (*(u64 *)&pte[i + 1] != 0) {
+            /* Another thread faulted here meanwhile, the window ends at its page */
+            break;
+        }
+        pte[i + 1].writable = 1;
+        pte[i + 1].user_page = 1;
+        pte[i + 1].page_base_addr = PAGE_TO_BASE_ADDR(frames[i]);
+        smp_wmb();
+        pte[i + 1].present = 1;
+        list_add_tail(&(nodes[i]->list), &(map->clock_hand));
+        petmem_set_frame_owner(frames[i], map, nodes[i]);
+    }
+    map->fa.ptes = (i > 0) ? &pte[1] : NULL;
+    map->fa.nr = i;
+    spin_unlock(&(map->pt_lock));
+
+    if (i < got) {
+        petmem_free_pages_bulk(&frames[i], got - i);
+    }
+    for (; i < nr; i++) {
+        kfree(nodes[i]);
+    }
+}
+
+/* Brings back a table swapped out by reclaim_level(), the same way handle_swap_in()
+ * does for data pages. Returns 0 once the caller should look at the entry again. */
+static int swap_in_table(struct mem_map * map, pte64_t * entry) {
+    uintptr_t table;
+    u32 index;
+
+    spin_lock(&(map->pt_lock));
+    if (entry->present) {
+        spin_unlock(&(map->pt_lock));
+        return 0;
+    }
+    if (entry->vmm_info & PTE_BUSY) {
+        spin_unlock(&(map->pt_lock));
+        wait_event(map->io_wait, !(PTE_VMM_INFO(entry) & PTE_BUSY));
+        return 0;
+    }
+    index = entry->page_base_addr;
+    entry->vmm_info |= PTE_BUSY;
+    spin_unlock(&(map->pt_lock));
+
+    table = alloc_frame(map);
+    if (table == 0 || map_swap_read(map, index, __va(table), PHASE_SWAP_IN) != 0) {
+        if (table) {
+            petmem_free_pages(table, 1);
+        }
+        spin_lock(&(map->pt_lock));
+        entry->vmm_info &= ~PTE_BUSY;
+        spin_unlock(&(map->pt_lock));
+        wake_up_all(&(map->io_wait));
+        return -1;
+    }
+
+    spin_lock(&(map->pt_lock));
+    entry->writable = 1;
+    entry->user_page = 1;
+    entry->vmm_info = 0;
+    entry->page_base_addr = PAGE_TO_BASE_ADDR(table);
+    smp_wmb();
+    entry->present = 1;
+    map->table_pages++;
+    atomic_long_inc(&petmem_table_pages);
+    spin_unlock(&(map->pt_lock));
+
+    /* Tables are written out again in full when they are next reclaimed, the copy is not kept */
+    free_block(map->swap, index);
+    wake_up_all(&(map->io_wait));
+    return 0;
+}
+
+/* Makes sure the table below entry exists. The page is allocated unlocked and
+ * installed under pt_lock, where another thread may have installed one first.
+ * Tables inside the petmem range (see table_in_region()) are taken from the petmem
+ * pools like data pages and counted in table_pages. Only a fault, with evict set,
+ * pushes data pages out for one; tables made ahead of time make do with free memory. */
+static int populate_table(struct mem_map * map, pte64_t * entry, int petmem_table, int evict) {
+    uintptr_t table;
+
+    while (!entry->present && PTE_VMM_INFO(entry)) {
+        /* Bringing a table back may evict, leave that to the fault */
+        if (!evict || (swap_in_table(map, entry) != 0)) {
+            return -1;
+        }
+    }
+    if (entry->present) {
+        return 0;
+    }
+
+    if (petmem_table) {
+        if (evict) {
+            table = alloc_zeroed_frame(map);
+        } else {
+            table = try_alloc_zeroed_frame();
+        }
+        if (table == 0) {
+            return -1;
+        }
+    } else {
+        table = get_zeroed_page(GFP_KERNEL);
+        if (table == 0) {
+            return -1;
+        }
+        table = __pa(table);
+    }
+
+    spin_lock(&(map->pt_lock));
+    if (!entry->present) {
+        entry->writable = 1;
+        entry->user_page = 1;
+        entry->page_base_addr = PAGE_TO_BASE_ADDR(table);
+        smp_wmb();
+        entry->present = 1;
+        if (petmem_table) {
+            map->table_pages++;
+            atomic_long_inc(&petmem_table_pages);
+        }
+        table = 0;
+    }
+    spin_unlock(&(map->pt_lock));
+
+    if (table == 0) {
+        return 0;
+    }
+    if (petmem_table) {
+        petmem_free_pages(table, 1);
+    } else {
+        free_page((uintptr_t)__va(table));
+    }
+    return 0;
+}
+
+/* Returns the page directory covering vaddr, creating the PDP and PD tables as needed.
+ * evict is passed on to populate_table(). */
+static pde64_t * walk_to_pd(struct mem_map * map, pml4e64_t * pml4, uintptr_t vaddr, int evict) {
+    pml4e64_t * pml4e = &pml4[PML4E64_INDEX(vaddr)];
+    pdpe64_t * pdpe;
+
+    if (populate_table(map, (pte64_t *)pml4e, 0, evict) != 0) {
+        return NULL;
+    }
+
+    pdpe = (pdpe64_t *)__va(BASE_TO_PAGE_ADDR(pml4e->pdp_base_addr)) + PDPE64_INDEX(vaddr);
+    if (populate_table(map, (pte64_t *)pdpe, 1, evict) != 0) {
+        return NULL;
+    }
+
+    return (pde64_t *)__va(BASE_TO_PAGE_ADDR(pdpe->pd_base_addr));
+}
+
+/* Returns the PDE for vaddr, creating the tables above it. If the walk cache also knows
+ * the page table below it, that is returned in pt. Called with vspace_sem held for read,
+ * which keeps every table, and so every cached one, in place. */
+static pde64_t * walk_to_pde(struct mem_map * map, uintptr_t vaddr, pte64_t ** pt) {
+    pde64_t * pd;
+    unsigned int seq;
+
+    do {
+        seq = read_seqbegin(&(map->walk_lock));
+        pd = (map->walk.pd_vaddr == PAGE_ADDR_1GB(vaddr)) ? map->walk.pd : NULL;
+        *pt = (map->walk.pt_vaddr == PAGE_ADDR_2MB(vaddr)) ? map->walk.pt : NULL;
+    } while (read_seqretry(&(map->walk_lock), seq));
+
+    if (pd == NULL) {
+        pd = walk_to_pd(map, (pml4e64_t *)CR3_TO_PML4E64_VA(get_cr3()), vaddr, 1);
+        if (pd == NULL) {
+            return NULL;
+        }
+    }
+    return &pd[PDE64_INDEX(vaddr)];
+}
+
+/* Returns the entry mapping vaddr, creating missing tables: the PTE, or the PDE
+ * if the 2 MB around vaddr are mapped by a large page. */
+static pte64_t * walk_to_pte(struct mem_map * map, uintptr_t vaddr) {
+    pde64_t * pde;
+    pte64_t * pt;
+
+    pde = walk_to_pde(map, vaddr, &pt);
+    if (pt) {
+        return &pt[PTE64_INDEX(vaddr)];
+    }
+    if (pde == NULL) {
+        return NULL;
+    }
+
+    if (populate_table(map, (pte64_t *)pde, 1, 1) != 0) {
+        return NULL;
+    }
+    if (pde->large_page) {
+        /* Another thread mapped a large page here first */
+        return (pte64_t *)pde;
+    }
+    pt = (pte64_t *)__va(BASE_TO_PAGE_ADDR(pde->pt_base_addr));
+
+    write_seqlock(&(map->walk_lock));
+    map->walk.pd_vaddr = PAGE_ADDR_1GB(vaddr);
+    map->walk.pd = (pde64_t *)((uintptr_t)pde & PAGE_MASK);
+    map->walk.pt_vaddr = PAGE_ADDR_2MB(vaddr);
+    map->walk.pt = pt;
+    write_sequnlock(&(map->walk_lock));
+
+    return &pt[PTE64_INDEX(vaddr)];
+}
+
+/* Maps the 2 MB around vaddr with one large PDE on first touch. Huge frames are not
+ * worth evicting, draining or compacting for: if no 2 MB block is free in the pools
+ * the fault takes a 4 KB page instead.
+ * Returns 0 if the fault is handled, 1 if the 4 KB path has to take it, -1 on error. */
+static int handle_huge_fault(struct mem_map * map, uintptr_t vaddr) {
+    pde64_2MB_t * pde;
+    struct vp_node * node;
+    uintptr_t frame;
+    pte64_t * pt;
+    u64 tsc;
+    int ret;
+
+    pde = (pde64_2MB_t *)walk_to_pde(map, vaddr, &pt);
+    if (pt) {
+        return 1;
+    }
+    if (pde == NULL) {
+        return -1;
+    }
+    if (*(u64 *)pde != 0) {
+        return (pde->present && pde->large_page) ? 0 : 1;
+    }
+
+    tsc = rdtsc_ordered();
+    /* ADD_MEMORY carves pools aligned to their size, so a 2 MB block is 2 MB aligned */
+    frame = petmem_try_alloc_pages(HUGE_PAGE_PAGES);
+    if (frame != 0) {
+        memset(__va(frame), 0, HUGE_PAGE_SIZE);
+    }
+    petmem_phase_end(map->stats, PHASE_FRAME_ALLOC, tsc);
+    if (frame == 0) {
+        return 1;
+    }
+
+    node = new_vp_node((pte64_t *)pde, PAGE_ADDR_2MB(vaddr));
+    if (node == NULL) {
+        petmem_free_pages(frame, HUGE_PAGE_PAGES);
+        return -1;
+    }
+    node->huge = 1;
+
+    spin_lock(&(map->pt_lock));
+    if (*(u64 *)pde != 0) {
+        /* Another thread got a table or a large page in first */
+        ret = (pde->present && pde->large_page) ? 0 : 1;
+        spin_unlock(&(map->pt_lock));
+        petmem_free_pages(frame, HUGE_PAGE_PAGES);
+        kfree(node);
+        return ret;
+    }
+    pde->writable = 1;
+    pde->user_page = 1;
+    pde->large_page = 1;
+    pde->page_base_addr = PAGE_TO_BASE_ADDR_2MB(frame);
+    smp_wmb();
+    pde->present = 1;
+    list_add_tail(&(node->list), &(map->clock_hand));
+    petmem_set_frame_owner(frame, map, node);
+    spin_unlock(&(map->pt_lock));
+    petmem_count(map->stats, PETMEM_FAULT_COMPULSORY);
+    return 0;
+}
+
+/* Maps a large page again after a split could not be done */
+static int split_huge_undo(struct mem_map * map, struct vp_node * node, uintptr_t frame) {
+    pde64_2MB_t * pde = (pde64_2MB_t *)node->pte;
+
+    spin_lock(&(map->pt_lock));
+    pde->vmm_info = 0;
+    set_bit(PTE_PRESENT_BIT, PTE_WORD(pde));
+    list_add_tail(&(node->list), &(map->clock_hand));
+    petmem_set_frame_owner(frame, map, node);
+    spin_unlock(&(map->pt_lock));
+
+    wake_up_all(&(map->io_wait));
+    return -1;
+}
+
+/* Turns a modified large page into 512 small ones, so eviction can take them one at a
+ * time. The first frame becomes the page table and its contents go to swap, so the
+ * split needs a swap slot but no frame. A large page that was never written is all
+ * zeroes and is simply dropped, all 512 frames at once.
+ * Called with pt_lock held and node off the list, drops pt_lock.
+ * Returns 0 if the page was split or dropped, -1 if it was put back. */
+static int split_huge_page(struct mem_map * map, struct vp_node * node) {
+    pde64_2MB_t * pde = (pde64_2MB_t *)node->pte;
+    uintptr_t frame = BASE_TO_PAGE_ADDR_2MB(pde->page_base_addr);
+    struct vp_node ** nodes = NULL;
+    struct tlb_batch tlb;
+    pte64_t * pt;
+    u32 index;
     int i;
-    //Frees up the swap space
 
-    swap_free(map->swap);
-	list_for_each_safe(pos, next, &(map->memory_allocations)){ // https://www.kernel.org/doc/htmldocs/kernel-api/API-list-for-each-safe.html
-        // next is actually n; a temporary storage
-		entry = list_entry(pos, struct vaddr_reg, list); // cast pos to vaddr_reg. list = the name of the list_head within the struct.
-        for(i = 0; i < entry->size; i++){ // Takes each virtual page tries to free it if physical memory is attached.
-            attempt_free_physical_address(entry->page_addr + (4096*i));
-        }
-		list_del(pos);
-		kfree(entry);
-	}
+    petmem_set_frame_owner(frame, NULL, NULL);
+    /* Faults on these 2 MB wait in populate_table() until the page table is in place */
+    clear_bit(PTE_PRESENT_BIT, PTE_WORD(pde));
+    pde->vmm_info = PTE_BUSY;
+    spin_unlock(&(map->pt_lock));
 
-    list_for_each_safe(pos, next, &(map->clock_hand)) {
-        node = list_entry(pos, struct vp_node, list);
-        list_del(pos);
+    tlb_batch_init(&tlb, map->mm);
+    tlb_batch_add(&tlb, node->vaddr);
+    tlb_batch_flush(&tlb);
+
+    if (!pde->dirty) {
+        spin_lock(&(map->pt_lock));
+        *(u64 *)pde = 0;
+        spin_unlock(&(map->pt_lock));
+        wake_up_all(&(map->io_wait));
+        petmem_free_pages(frame, HUGE_PAGE_PAGES);
         kfree(node);
+        return 0;
     }
 
-	kfree(map);
+    if (swap_alloc_slot(map->swap, &index) != 0) {
+        return split_huge_undo(map, node, frame);
+    }
+    nodes = kzalloc((HUGE_PAGE_PAGES - 1) * sizeof(struct vp_node *), GFP_KERNEL);
+    for (i = 1; nodes != NULL && i < HUGE_PAGE_PAGES; i++) {
+        nodes[i - 1] = new_vp_node(NULL, node->vaddr + ((uintptr_t)i << PAGE_POWER_4KB));
+        if (nodes[i - 1] == NULL) {
+            for (i = 1; i < HUGE_PAGE_PAGES; i++) {
+                kfree(nodes[i - 1]);
+            }
+            kfree(nodes);
+            nodes = NULL;
+        }
+    }
+    if (nodes == NULL) {
+        free_block(map->swap, index);
+        return split_huge_undo(map, node, frame);
+    }
+    map_swap_write(map, index, __va(frame), PHASE_SWAP_OUT);
 
-}
+    pt = (pte64_t *)__va(frame);
+    memset(pt, 0, PAGE_SIZE);
+    pt[0].page_base_addr = index;
+    pt[0].vmm_info = PTE_SWAPPED;
+    for (i = 1; i < HUGE_PAGE_PAGES; i++) {
+        pt[i].writable = 1;
+        pt[i].user_page = 1;
+        pt[i].dirty = 1;
+        pt[i].page_base_addr = PAGE_TO_BASE_ADDR(frame + ((uintptr_t)i << PAGE_POWER_4KB));
+        pt[i].present = 1;
+        nodes[i - 1]->pte = &pt[i];
+    }
 
-/* called by petmem_ioctl() in case of LAZY_ALLOC. */
-uintptr_t petmem_alloc_vspace(struct mem_map * map, u64 num_pages) { // Only for allocating virtual memory
-    printk("Memory allocation\n");
-    return allocate(&(map->memory_allocations), num_pages);
-}
+    spin_lock(&(map->pt_lock));
+    for (i = 1; i < HUGE_PAGE_PAGES; i++) {
+        /* At the head of the queue, they are what eviction takes next */
+        list_add(&(nodes[i - 1]->list), &(map->clock_hand));
+        petmem_set_frame_owner(frame + ((uintptr_t)i << PAGE_POWER_4KB), map, nodes[i - 1]);
+    }
+    *(u64 *)pde = 0;
+    ((pde64_t *)pde)->writable = 1;
+    ((pde64_t *)pde)->user_page = 1;
+    ((pde64_t *)pde)->pt_base_addr = PAGE_TO_BASE_ADDR(frame);
+    smp_wmb();
+    pde->present = 1;
+    map->table_pages++;
+    atomic_long_inc(&petmem_table_pages);
+    spin_unlock(&(map->pt_lock));
 
-void petmem_dump_vspace(struct mem_map * map) {
+    wake_up_all(&(map->io_wait));
+    kfree(nodes);
+    kfree(node);
+    return 0;
 }
 
-// Only the PML needs to stay, everything else can be freed
-void petmem_free_vspace(struct mem_map * map, uintptr_t vaddr) {
-    printk("Free memory\n");
-	free_address(&(map->memory_allocations), vaddr);
-    return;
+/* Creates the page directories for a new region up front, so its faults only ever
+ * allocate page tables. Best effort from free memory, nothing is evicted for tables
+ * that may never be used; whatever is missing is filled in by faults. */
+static void populate_upper_tables(struct mem_map * map, uintptr_t start, uintptr_t end) {
+    uintptr_t addr;
 
+    for (addr = PAGE_ADDR_1GB(start); addr < end; addr += (1UL << PAGE_POWER_1GB)) {
+        if (walk_to_pd(map, (pml4e64_t *)map->mm->pgd, addr, 0) == NULL) {
+            return;
+        }
+    }
 }
 
 /* called by page fault handler to handle the multiple level of page tables. */
@@ -108,213 +1170,532 @@ void petmem_free_vspace(struct mem_map * map, uintptr_t vaddr) {
  * Though this does use pte64_t, it works with
  * all types of 64, but there is no general one.
  */
-int handle_table_memory(void * mem, struct mem_map * map){
+int handle_table_memory(void * mem, struct mem_map * map, uintptr_t vaddr){
     uintptr_t temp;
     uintptr_t memory;
     pte64_t * handle = (pte64_t *)mem;
-    struct vp_node *new_node;
+    struct vp_node * node;
 
-    memory = petmem_alloc_pages(1);
-    if (memory == 0) {
-        clear_up_memory(map, handle);
-        memory = petmem_alloc_pages(1);
-    } else {
-        new_node = (struct vp_node *)kmalloc(sizeof(struct vp_node), GFP_KERNEL);
-        new_node->pte = handle;
-		INIT_LIST_HEAD(&(new_node->list));
-        list_add_tail(&(new_node->list), &(map->clock_hand));
+    /* Get a zeroed frame before taking any lock */
+    memory = alloc_zeroed_frame(map);
+    node = new_vp_node(handle, vaddr);
+    if (memory == 0 || node == NULL) {
+        if (memory) {
+            petmem_free_pages(memory, 1);
+        }
+        kfree(node);
+        return 1;
     }
     temp = (uintptr_t)__va(memory);
-    printk("Allocated virtual memory is: 0x%012lx, and its physical memory is:0x%012lx\n", temp, __pa(temp));
+    petmem_dbg("Allocated virtual memory is: 0x%012lx, and its physical memory is:0x%012lx\n", temp, __pa(temp));
+
+    spin_lock(&(map->pt_lock));
+    if (handle->present || handle->vmm_info) {
+        /* Another thread mapped it, or evicted it again, while we were allocating */
+        spin_unlock(&(map->pt_lock));
+        petmem_free_pages(memory, 1);
+        kfree(node);
+        return 0;
+    }
    //screw it, other way didn't copy permissions, must set them!
-    memset((void *)temp, 0, 512*8);
-	handle->present = 1;
     handle->writable = 1;
     handle->user_page =1;
+    handle->accessed = 0;
+    handle->dirty = 0;
 	handle->page_base_addr = PAGE_TO_BASE_ADDR( __pa(temp ));
+    smp_wmb();
+	handle->present = 1;
+    list_add_tail(&(node->list), &(map->clock_hand));
+    petmem_set_frame_owner(memory, map, node);
+    spin_unlock(&(map->pt_lock));
     return 0;
 }
 
-uintptr_t get_valid_page_entry(uintptr_t address){
-    pte64_t * entries[4];
-    /* If one of them isn't there, we don't need to free any physical address because there is none.*/
-    entries[3] = (pte64_t *) (CR3_TO_PML4E64_VA( get_cr3() ) + PML4E64_INDEX( address ) * 8);
-    if(!entries[3]->present) {
+/* Brings a swapped page back in. The slot is read with no lock held while PTE_BUSY
+ * keeps other threads off the page, and is kept so the page can be dropped without
+ * a write while it stays clean. A prefetch neither waits nor evicts. */
+static int handle_swap_in(struct mem_map * map, pte64_t * pte, uintptr_t vaddr, int prefetch) {
+    char * space;
+    uintptr_t memory;
+    struct vp_node * node;
+    u32 index;
+
+    spin_lock(&(map->pt_lock));
+    if (pte->present) {
+        spin_unlock(&(map->pt_lock));
         return 0;
     }
-    entries[2] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[3]->page_base_addr ) + (PDPE64_INDEX( address ) * 8)) ;
-    if(!entries[2]->present) {
+    if (prefetch && (pte->vmm_info & PTE_BUSY || !PTE_IS_SWAPPED(pte))) {
+        spin_unlock(&(map->pt_lock));
         return 0;
     }
-
-    entries[1] = (pte64_t *)__va(BASE_TO_PAGE_ADDR( entries[2]->page_base_addr ) + PDE64_INDEX( address )* 8);
-    if(!entries[1]->present) {
+    if (pte->vmm_info & PTE_BUSY) {
+        /* Someone else is moving this page, the access is retried once they are done */
+        spin_unlock(&(map->pt_lock));
+        wait_event(map->io_wait, !(PTE_VMM_INFO(pte) & PTE_BUSY));
         return 0;
     }
+    if (!PTE_IS_SWAPPED(pte)) {
+        /* Dropped as a clean zero page since the fault was raised */
+        spin_unlock(&(map->pt_lock));
+        return handle_table_memory((void *)pte, map, vaddr);
+    }
+    index = pte->page_base_addr;
+    pte->vmm_info |= PTE_BUSY;
+    spin_unlock(&(map->pt_lock));
 
-    // entries[1]->page_base_addr  = Physical page number of PTE and PTE64_INDEX( address ) 12-20 bits of CR3
-    entries[0] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[1]->page_base_addr ) + PTE64_INDEX( address ) * 8 );
-    if(!entries[0]->present) {
-        return 0;
+    /* evicts other pages if we are out of frames, then the slot is read straight into the frame */
+    memory = prefetch ? petmem_alloc_pages(1) : alloc_frame(map);
+    node = new_vp_node(pte, vaddr);
+    if (memory == 0 || node == NULL ||
+        map_swap_read(map, index, __va(memory), prefetch ? PHASE_BACKGROUND_IO : PHASE_SWAP_IN) != 0) {
+        if (memory) {
+            petmem_free_pages(memory, 1);
+        }
+        kfree(node);
+        spin_lock(&(map->pt_lock));
+        pte->vmm_info &= ~PTE_BUSY;
+        spin_unlock(&(map->pt_lock));
+        wake_up_all(&(map->io_wait));
+        return 1;
+    }
+    node->swap_index = index;
+    node->swap_valid = 1;
+    node->prefetched = prefetch;
+    space = (char *)__va(memory);
+    petmem_dbg("Swapped in the page, should be a b: %c\n", space[0]);
+
+    spin_lock(&(map->pt_lock));
+    pte->writable = 1;
+    pte->user_page = 1;
+    pte->accessed = 0;
+    pte->dirty = 0;
+    pte->vmm_info = 0;
+    pte->page_base_addr = PAGE_TO_BASE_ADDR( __pa(space));
+    smp_wmb();
+    pte->present = 1;
+    list_add_tail(&(node->list), &(map->clock_hand));
+    petmem_set_frame_owner(memory, map, node);
+    if (prefetch) {
+        map->prefetch_issued++;
     }
-    return (uintptr_t)entries[0];
+    spin_unlock(&(map->pt_lock));
+
+    wake_up_all(&(map->io_wait));
+    trace_petmem_swap_in(vaddr, index, prefetch);
+    return 0;
+}
+
+/* A page has to be written to swap only if it was modified since it was last mapped */
+int page_needs_write(struct vp_node * node) {
+    pte64_t * pte = (pte64_t *)node->pte;
+
+    return pte->dirty;
 }
 
-// mem: page to replace, pte: new page
-void * page_replacement_clock(struct mem_map * map, void ** mem, void * new_pte){
+/* Called with pt_lock held. Returns NULL if this process has no resident pages. */
+struct vp_node * page_replacement_clock(struct mem_map * map){
     pte64_t * old_pte;
-    struct list_head * pos, * next;
     struct vp_node *node;
+    int pass;
 
-    while (1) {
-        list_for_each_safe(pos, next, &(map->clock_hand)) {
-            node = list_entry(pos, struct vp_node, list);
+    if (list_empty(&(map->clock_hand))) {
+        return NULL;
+    }
+
+    /* First pass: a page that is neither recently used nor modified can go without any I/O */
+    list_for_each_entry(node, &(map->clock_hand), list) {
+        old_pte = (pte64_t *)node->pte;
+        if (!old_pte->accessed && !page_needs_write(node)) {
+            list_move_tail(&(map->clock_hand), &(node->list)); // Change clock hand
+            petmem_dbg("FOUND A CLEAN PAGE TO REPLACE!!!\n");
+            return node;
+        }
+    }
+
+    /* Second chance; after one full sweep every accessed bit is clear, so two are enough */
+    for (pass = 0; pass < 2; pass++) {
+        list_for_each_entry(node, &(map->clock_hand), list) {
             old_pte = (pte64_t *)node->pte;
 
-            if (old_pte && old_pte->accessed) {
-                old_pte->accessed = 0;
-                printk("Found a page, but it gets a second chance. lucky bastard.\n");
+            if (old_pte->accessed) {
+                prefetch_account(map, node);
+                /* The MMU may be setting the dirty bit in the same word */
+                clear_bit(PTE_ACCESSED_BIT, PTE_WORD(old_pte));
+                petmem_dbg("Found a page, but it gets a second chance. lucky bastard.\n");
             }
-            else if (old_pte) {
+            else {
                 list_move_tail(&(map->clock_hand), &(node->list)); // Change clock hand
-                node->pte = new_pte;
-                printk("FOUND A PAGE TO REPLACE!!!\n");
-                *mem = (__va( BASE_TO_PAGE_ADDR( old_pte->page_base_addr ) ));
-                return (void *)old_pte;
+                petmem_dbg("FOUND A PAGE TO REPLACE!!!\n");
+                return node;
             }
         }
     }
+
+    /* Threads kept touching everything, take whatever is under the hand */
+    return list_entry(map->clock_hand.next, struct vp_node, list);
 }
 
-void * page_replacement_fifo(struct mem_map * map, void ** mem, void * new_pte){
-    pte64_t * old_pte;
-    struct vp_node *node;
+/* Called with pt_lock held. Returns NULL if this process has no resident pages. */
+struct vp_node * page_replacement_fifo(struct mem_map * map){
+    struct vp_node *node, *victim;
+    int scanned = 0;
 
-    node = list_entry(map->clock_hand.next, struct vp_node, list); // FIFO is QUEUE
-    old_pte = (pte64_t *)node->pte;
-    list_move_tail(&(node->list), &(map->clock_hand)); // Move the node so that it will pop last from queue
-    node->pte = new_pte;
+    if (list_empty(&(map->clock_hand))) {
+        return NULL;
+    }
+
+    victim = list_entry(map->clock_hand.next, struct vp_node, list); // FIFO is QUEUE
+
+    /* Prefer the oldest page that needs no write-back, but only look a short way down the queue */
+    list_for_each_entry(node, &(map->clock_hand), list) {
+        if (scanned++ == CLEAN_SCAN_LIMIT) {
+            break;
+        }
+        if (!page_needs_write(node)) {
+            victim = node;
+            break;
+        }
+    }
+
+    petmem_dbg("FOUND A PAGE TO REPLACE!!!\n");
+    return victim;
+}
 
-    printk("FOUND A PAGE TO REPLACE!!!\n");
-    *mem = (__va( BASE_TO_PAGE_ADDR( old_pte->page_base_addr ) ));
-    return (void *)old_pte;
+/* Takes a slot away from a resident page that was only keeping it as a clean copy.
+ * Called with pt_lock held. */
+static int steal_swap_slot(struct mem_map * map, u32 * index) {
+    struct vp_node * node;
+    pte64_t * pte;
+    int pass;
+
+    /* Stale copies of modified pages go first, they would have to be rewritten anyway */
+    for (pass = 0; pass < 2; pass++) {
+        list_for_each_entry(node, &(map->clock_hand), list) {
+            pte = (pte64_t *)node->pte;
+            if (!node->swap_valid || (pass == 0 && !pte->dirty)) {
+                continue;
+            }
+            node->swap_valid = 0;
+            /* The contents now only live in memory, so it must be written out when evicted */
+            set_bit(PTE_DIRTY_BIT, PTE_WORD(pte));
+            *index = node->swap_index;
+            return 0;
+        }
+    }
+    return -1;
 }
 
-void clear_up_memory(struct mem_map * map, void * new_pte) { 
+static inline void count_eviction(struct mem_map * map) {
+    petmem_count(map->stats, (strcmp(map->policy_name, FIFO_POLICY) == 0) ? PETMEM_EVICT_FIFO : PETMEM_EVICT_CLOCK);
+}
+
+int clear_up_memory(struct mem_map * map) {
     u32 index;
-    pte64_t * pte_to_replace, * mem_location;
+    struct vp_node * victim;
+    pte64_t * pte_to_replace;
+    void * mem_location;
+    int needs_write;
+    struct tlb_batch tlb;
+    u64 tsc;
 
     index = 0;
-    printk("GETTING SOME MO MEMZ\n");
+    petmem_dbg("GETTING SOME MO MEMZ\n");
+
+    spin_lock(&(map->pt_lock));
+    tsc = rdtsc_ordered();
     /* pick a page based on the swap policy - clock policy is default */
     if (strcmp(map->policy_name, FIFO_POLICY) == 0) {
-        pte_to_replace = (pte64_t *)page_replacement_fifo(map, (void **)&mem_location, new_pte);
+        victim = page_replacement_fifo(map);
+    } else {
+        victim = page_replacement_clock(map);
+    }
+    petmem_phase_end(map->stats, PHASE_VICTIM_SELECT, tsc);
+    if (victim == NULL) {
+        spin_unlock(&(map->pt_lock));
+        return -1;
+    }
+    list_del(&(victim->list));
+    prefetch_account(map, victim);
+    if (victim->huge) {
+        if (split_huge_page(map, victim) != 0) {
+            return -1;
+        }
+        count_eviction(map);
+        return 0;
+    }
+
+    pte_to_replace = (pte64_t *)victim->pte;
+    mem_location = __va( BASE_TO_PAGE_ADDR( pte_to_replace->page_base_addr ) );
+    petmem_set_frame_owner(BASE_TO_PAGE_ADDR( pte_to_replace->page_base_addr ), NULL, NULL);
+
+    /* Faults on the page wait in handle_swap_in() until it is settled below */
+    clear_bit(PTE_PRESENT_BIT, PTE_WORD(pte_to_replace));
+    pte_to_replace->vmm_info = PTE_SWAPPED | PTE_BUSY;
+    spin_unlock(&(map->pt_lock));
+
+    /* Once the TLB entry is gone nobody can dirty the page any more, so the dirty bit
+     * read after this is final. The shootdown waits for other CPUs, so not under pt_lock. */
+    tlb_batch_init(&tlb, map->mm);
+    tlb_batch_add(&tlb, victim->vaddr);
+    tlb_batch_flush(&tlb);
+
+    spin_lock(&(map->pt_lock));
+    needs_write = pte_to_replace->dirty;
+
+    if (!needs_write && !victim->swap_valid) {
+        /* Never written since it was zero filled, the next touch is simply compulsory again */
+        pte_to_replace->vmm_info = 0;
+        pte_to_replace->page_base_addr = 0;
     } else {
-        pte_to_replace = (pte64_t *)page_replacement_clock(map, (void **)&mem_location, new_pte);
+        if (victim->swap_valid) {
+            /* Unmodified pages still have their contents there, modified ones are rewritten in place */
+            index = victim->swap_index;
+        } else if (swap_alloc_slot(map->swap, &index) != 0 && steal_swap_slot(map, &index) != 0) {
+            /* Nowhere to write it, so the page stays resident and the caller gets no frame */
+            pte_to_replace->vmm_info = 0;
+            set_bit(PTE_PRESENT_BIT, PTE_WORD(pte_to_replace));
+            list_add_tail(&(victim->list), &(map->clock_hand));
+            petmem_set_frame_owner(__pa(mem_location), map, victim);
+            spin_unlock(&(map->pt_lock));
+            wake_up_all(&(map->io_wait));
+            printk(KERN_ERR "Swap space exhausted, cannot evict a modified page\n");
+            return -1;
+        }
+        /* we memorize that this page is written to index page of the swap space. */
+        pte_to_replace->page_base_addr = index;
+        pte_to_replace->vmm_info = PTE_SWAPPED | (needs_write ? PTE_BUSY : 0);
     }
-    pte_to_replace->present = 0;
-    pte_to_replace->dirty = 1;
-    swap_out_page(map->swap, &index, mem_location);
+    pte_to_replace->dirty = 0;
+    pte_to_replace->accessed = 0;
+    spin_unlock(&(map->pt_lock));
+    count_eviction(map);
+    trace_petmem_evict(victim->vaddr, index, needs_write);
+
+    if (needs_write) {
+        map_swap_write(map, index, mem_location, PHASE_SWAP_OUT);
+
+        spin_lock(&(map->pt_lock));
+        pte_to_replace->vmm_info &= ~PTE_BUSY;
+        spin_unlock(&(map->pt_lock));
+    }
+    wake_up_all(&(map->io_wait));
+
     petmem_free_pages((uintptr_t)__pa(mem_location), 1);
-	/* we memorize that this page is written to index page of the swap space. */
-    pte_to_replace->page_base_addr = index;
+    kfree(victim);
+    return 0;
+}
+
+struct prefetch_req {
+    struct work_struct work;
+    struct mem_map * map;
+    uintptr_t addrs[PREFETCH_MAX];
+    int nr;
+};
+
+/* The PTE mapping vaddr if every table above it is resident, else NULL. Uses the
+ * process's own tables, a worker runs on whatever CR3 it was given. */
+static pte64_t * lookup_pte(struct mem_map * map, uintptr_t vaddr) {
+    pte64_t * entry = (pte64_t *)map->mm->pgd + PML4E64_INDEX(vaddr);
+    int level;
 
+    for (level = 3; level > 0; level--) {
+        if (!entry->present || (level == 1 && ((pde64_t *)entry)->large_page)) {
+            return NULL;
+        }
+        entry = (pte64_t *)__va(BASE_TO_PAGE_ADDR(entry->page_base_addr));
+        entry += (vaddr >> (PAGE_SHIFT + (9 * (level - 1)))) & 0x1ff;
+    }
+    return entry;
 }
-int petmem_handle_pagefault(struct mem_map * map, uintptr_t fault_addr, u32 error_code) {
-	pml4e64_t * cr3;
-	pdpe64_t * pdp;
-	pde64_t * pde;
-	pte64_t * pte;
-    int bad_signal = 0;
-    int valid_range = check_address_range(map, fault_addr);
-    char * space;
 
-    printk("Handling segfault\n");
-    if(valid_range == NOT_VALID_RANGE|| error_code == ERROR_PERMISSION ){
-        return -1;
+static void prefetch_work(struct work_struct * work) {
+    struct prefetch_req * req = container_of(work, struct prefetch_req, work);
+    struct mem_map * map = req->map;
+    pte64_t * pte;
+    int i;
+
+    down_read(&(map->vspace_sem));
+    for (i = 0; i < req->nr && !map->mm_gone; i++) {
+        /* The region may have been freed since, and the page faulted in or dropped */
+        if (fault_region(map, req->addrs[i]) == NULL) {
+            break;
+        }
+        pte = lookup_pte(map, req->addrs[i]);
+        if (pte == NULL || pte->present || !PTE_IS_SWAPPED(pte)) {
+            continue;
+        }
+        if (handle_swap_in(map, pte, req->addrs[i], 1) != 0) {
+            /* Out of free frames, prefetching must not evict */
+            break;
+        }
     }
+    up_read(&(map->vspace_sem));
 
-    cr3 = (pml4e64_t *) (CR3_TO_PML4E64_VA( get_cr3() ) + PML4E64_INDEX( fault_addr ) * 8);
-    if(!cr3->present) {
-       GENERATE_TABLE(cr3, pdp_base_addr);
+    atomic_dec(&(map->prefetch_pending));
+    kfree(req);
+}
+
+/* Feeds a swap-in fault to its region's stream detector. Once the distance between
+ * faults repeats (1 page forward, 1 back, or any constant stride) the next pages of
+ * the stream are read in on the prefetch workqueue. */
+static void prefetch_predict(struct mem_map * map, struct vaddr_reg * reg, uintptr_t vaddr) {
+    uintptr_t reg_end = reg->page_addr + (reg->size << PAGE_POWER_4KB);
+    struct prefetch_req * req;
+    s64 stride;
+    s64 next;
+    int depth = 0;
+    int i;
+
+    spin_lock(&(map->pt_lock));
+    map->swapin_faults++;
+    stride = (s64)vaddr - (s64)reg->stream.last;
+    if (reg->stream.last != 0 && stride != 0 && stride == reg->stream.stride) {
+        if (reg->stream.repeats < 3) {
+            reg->stream.repeats++;
+        }
+        depth = PREFETCH_DEPTH << (reg->stream.repeats - 1);
+    } else {
+        reg->stream.stride = stride;
+        reg->stream.repeats = 0;
     }
+    reg->stream.last = vaddr;
+    spin_unlock(&(map->pt_lock));
 
-    pdp = (pdpe64_t *)__va( BASE_TO_PAGE_ADDR( cr3->pdp_base_addr ) + (PDPE64_INDEX( fault_addr ) * 8)) ;
-    if(!pdp->present) {
-        GENERATE_TABLE(pdp, pd_base_addr);
+    if (depth == 0) {
+        return;
+    }
+    /* Take the slot before queueing, so racing faults cannot overshoot the limit */
+    if (atomic_inc_return(&(map->prefetch_pending)) > PREFETCH_MAX_PENDING) {
+        atomic_dec(&(map->prefetch_pending));
+        return;
+    }
 
+    req = kmalloc(sizeof(struct prefetch_req), GFP_KERNEL);
+    if (req == NULL) {
+        atomic_dec(&(map->prefetch_pending));
+        return;
+    }
+    req->map = map;
+    req->nr = 0;
+    for (i = 1; i <= min(depth, PREFETCH_MAX); i++) {
+        next = (s64)vaddr + (i * stride);
+        if (next < (s64)reg->page_addr || next >= (s64)reg_end) {
+            break;
+        }
+        req->addrs[req->nr++] = next;
+    }
+    if (req->nr == 0) {
+        atomic_dec(&(map->prefetch_pending));
+        kfree(req);
+        return;
     }
 
+    INIT_WORK(&(req->work), prefetch_work);
+    queue_work(petmem_prefetch_wq, &(req->work));
+}
+
+/* The full walk for one fault, printed only with debug output on */
+static void dump_fault_walk(uintptr_t fault_addr, u32 error_code, pte64_t * pte) {
+    pml4e64_t * cr3;
+    pdpe64_t * pdp;
+    pde64_t * pde;
+
+    /* The fault path made sure every level exists */
+    cr3 = (pml4e64_t *)((uintptr_t)CR3_TO_PML4E64_VA( get_cr3() ) + PML4E64_INDEX( fault_addr ) * 8);
+    pdp = (pdpe64_t *)__va( BASE_TO_PAGE_ADDR( cr3->pdp_base_addr ) + (PDPE64_INDEX( fault_addr ) * 8)) ;
     pde = (pde64_t *)__va(BASE_TO_PAGE_ADDR( pdp->pd_base_addr ) + PDE64_INDEX( fault_addr )* 8);
-    if(!pde->present) {
-        GENERATE_TABLE(pde, pt_base_addr);
+
+    printk(KERN_DEBUG "~~~~~~~~~~~~~~~~~~~~~NEW PAGE FAULT!~~~~~~~~~~~~\n");
+    printk(KERN_DEBUG "Error code: %d\n", error_code);
+    printk(KERN_DEBUG "Fault Address 0x%012lx\n", fault_addr);
+
+    printk(KERN_DEBUG "\nCR3 FULL SUMMARY:\n");
+    printk(KERN_DEBUG "PML4 offset: %lld\n", PML4E64_INDEX(fault_addr));
+    printk(KERN_DEBUG "PML4 index: %lld (0x%03x)\n", PML4E64_INDEX(fault_addr) * 8, (int)PML4E64_INDEX(fault_addr) * 8);
+    printk(KERN_DEBUG "The Physical Address:0x%012llx\n", (CR3_TO_PML4E64_PA( get_cr3() ) + PML4E64_INDEX( fault_addr) * 8));
+    printk(KERN_DEBUG "Virtual Address: 0x%012lx\n", (long unsigned int)cr3);
+    printk(KERN_DEBUG "Page address to next level from cr3 : 0x%012lx\n", (long unsigned int)cr3->pdp_base_addr);
+    printk(KERN_DEBUG "\nPDP FULL SUMMARY:\n");
+    printk(KERN_DEBUG "PDP offset: %lld\n", PDPE64_INDEX(fault_addr));
+    printk(KERN_DEBUG "PDP index: %lld (0x%03x)\n", PDPE64_INDEX(fault_addr) * 8, (int)PDPE64_INDEX(fault_addr) * 8);
+    printk(KERN_DEBUG "The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(cr3->pdp_base_addr) + PDPE64_INDEX( fault_addr) * 8));
+    printk(KERN_DEBUG "Virtual Address: 0x%012lx\n", (long unsigned int)pdp);
+    printk(KERN_DEBUG "Page address to next level from pdp : 0x%012lx\n", (long unsigned int)pdp->pd_base_addr);
+    printk(KERN_DEBUG "\nPDE FULL SUMMARY:\n");
+    printk(KERN_DEBUG "PDE offset: %lld\n", PDE64_INDEX(fault_addr));
+    printk(KERN_DEBUG "PDE index: %lld (0x%03x)\n", PDE64_INDEX(fault_addr) * 8, (int)PDE64_INDEX(fault_addr) * 8);
+    printk(KERN_DEBUG "The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(pdp->pd_base_addr) + PDE64_INDEX( fault_addr) * 8));
+    printk(KERN_DEBUG "Virtual Address: 0x%012lx\n", (long unsigned int)pde);
+    printk(KERN_DEBUG "Page address to next level from pde : 0x%012lx\n", (long unsigned int)pde->pt_base_addr);
+    printk(KERN_DEBUG "\nPTE FULL SUMMARY:\n");
+    printk(KERN_DEBUG "PTE offset: %lld\n", PTE64_INDEX(fault_addr));
+    printk(KERN_DEBUG "PTE index: %lld (0x%03x)\n", PTE64_INDEX(fault_addr) * 8, (int)PTE64_INDEX(fault_addr) * 8);
+    printk(KERN_DEBUG "The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(pde->pt_base_addr) + PTE64_INDEX( fault_addr) * 8));
+    printk(KERN_DEBUG "Virtual Address: 0x%012lx\n", (long unsigned int)pte);
+    printk(KERN_DEBUG "Memory at this : 0x%012lx\n", (long unsigned int)pte->page_base_addr);
+}
+
+static int handle_pagefault(struct mem_map * map, uintptr_t fault_addr, u32 error_code) {
+	pte64_t * pte;
+	struct vaddr_reg * reg;
+    u64 tsc;
+    int bad_signal = 0;
+    int ret = 1;
+
+    trace_petmem_fault(fault_addr, error_code);
+    if(error_code == ERROR_PERMISSION){
+        return -1;
     }
 
-    pte = (pte64_t *)__va( BASE_TO_PAGE_ADDR( pde->pt_base_addr ) + PTE64_INDEX( fault_addr ) * 8 );
+    /* Held for the whole fault so the region and its page tables cannot go away under us */
+    down_read(&(map->vspace_sem));
+    tsc = rdtsc_ordered();
+    reg = fault_region(map, fault_addr);
+    petmem_phase_end(map->stats, PHASE_REGION_LOOKUP, tsc);
+    if(reg == NULL){
+        up_read(&(map->vspace_sem));
+        return -1;
+    }
+
+    /* Large pages only where the whole 2 MB around the fault belongs to this region */
+    if (reg->size >= HUGE_PAGE_PAGES &&
+        PAGE_ADDR_2MB(fault_addr) >= reg->page_addr &&
+        PAGE_ADDR_2MB(fault_addr) + HUGE_PAGE_SIZE <= reg->page_addr + (reg->size << PAGE_POWER_4KB)) {
+        ret = handle_huge_fault(map, fault_addr);
+    }
+    if (ret <= 0) {
+        up_read(&(map->vspace_sem));
+        return ret;
+    }
 
-    // TODO: Check the dirty bit as well, to differentiate between compulsory vs swapped out.
+    tsc = rdtsc_ordered();
+    pte = walk_to_pte(map, fault_addr);
+    petmem_phase_end(map->stats, PHASE_TABLE_WALK, tsc);
+    if (pte == NULL) {
+        up_read(&(map->vspace_sem));
+        return -1;
+    }
 
     if (!pte->present) {
-        if(!pte->dirty) { // Dirty means it was touched at least once in its lifetime
-            bad_signal += handle_table_memory((void *) pte, map);
+        if(!PTE_IS_SWAPPED(pte)) { // Never swapped out, the first touch is a compulsory fault
+            petmem_count(map->stats, PETMEM_FAULT_COMPULSORY);
+            bad_signal += handle_table_memory((void *) pte, map, PAGE_ADDR(fault_addr));
+            if (!bad_signal) {
+                fault_around(map, reg, pte, PAGE_ADDR(fault_addr));
+            }
         }
         else {
-            void * page = kmalloc(4096,GFP_KERNEL);
-            //Swap out memory using page_address.
-            printk("Got here\n");
-            /* in page fault handler, we know we run of memory, so we swap a page in. */
-            swap_in_page(map->swap, pte->page_base_addr, page);
-            printk("Swapped in the page\n");
-            space = (void *)petmem_alloc_pages(1);
-            /* when space is 0, it tells us it's time to swap some pages out. */
-            if (space == 0){
-                clear_up_memory(map, pte);
-                space = (void * )petmem_alloc_pages(1);
-            }
-            printk("Allocated space for new page.\n");
-            space = (void *)__va(space);
-            memcpy(space, page, PAGE_SIZE_BYTES);
-            kfree(page);
-            printk("SPACE\n");
-            printk("Should be a b: %c\n", space[0]);
-            pte->present = 1;
-            pte->writable = 1;
-            pte->user_page = 1;
-            pte->dirty = 0;
-            pte->page_base_addr = PAGE_TO_BASE_ADDR( __pa(space));
-            printk("Done.\n");
-        }
-    }
-#ifdef DEBUG
-    printk("~~~~~~~~~~~~~~~~~~~~~NEW PAGE FAULT!~~~~~~~~~~~~\n");
-    printk("Error code: %d\n", error_code);
-	printk("Fault Address 0x%012lx\n", fault_addr);
-
-    printk("\nCR3 FULL SUMMARY:\n");
-    printk("PML4 offset: %lld\n", PML4E64_INDEX(fault_addr));
-    printk("PML4 index: %lld (0x%03x)\n", PML4E64_INDEX(fault_addr) * 8, (int)PML4E64_INDEX(fault_addr) * 8);
-    printk("The Physical Address:0x%012llx\n", (CR3_TO_PML4E64_PA( get_cr3() ) + PML4E64_INDEX( fault_addr) * 8));
-    printk("Virtual Address: 0x%012lx\n", (long unsigned int)cr3);
-    printk("Page address to next level from cr3 : 0x%012lx\n", (long unsigned int)cr3->pdp_base_addr);
-    printk("\nPDP FULL SUMMARY:\n");
-    printk("PDP offset: %lld\n", PDPE64_INDEX(fault_addr));
-    printk("PDP index: %lld (0x%03x)\n", PDPE64_INDEX(fault_addr) * 8, (int)PDPE64_INDEX(fault_addr) * 8);
-    printk("The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(cr3->pdp_base_addr) + PDPE64_INDEX( fault_addr) * 8));
-    printk("Virtual Address: 0x%012lx\n", (long unsigned int)pdp);
-    printk("Page address to next level from pdp : 0x%012lx\n", (long unsigned int)pdp->pd_base_addr);
-    printk("\nPDE FULL SUMMARY:\n");
-    printk("PDE offset: %lld\n", PDE64_INDEX(fault_addr));
-    printk("PDE index: %lld (0x%03x)\n", PDE64_INDEX(fault_addr) * 8, (int)PDE64_INDEX(fault_addr) * 8);
-    printk("Hmmm...what is the PDE index? %lld\n", PDE64_INDEX(fault_addr) * 8);
-    printk("The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(pdp->pd_base_addr) + PDE64_INDEX( fault_addr) * 8));   printk("Virtual Address: 0x%012lx\n", (long unsigned int)pde);
-    printk("Page address to next level from pde : 0x%012lx\n", (long unsigned int)pde->pt_base_addr);
-    printk("\nPTE FULL SUMMARY:\n");
-    printk("PTE offset: %lld\n", PTE64_INDEX(fault_addr));
-    printk("PTE index: %lld (0x%03x)\n", PTE64_INDEX(fault_addr) * 8, (int)PTE64_INDEX(fault_addr) * 8);
-    printk("The Physical Address:0x%012llx\n", (BASE_TO_PAGE_ADDR(pde->pt_base_addr) + PTE64_INDEX( fault_addr) * 8));
-    printk("Virtual Address: 0x%012lx\n", (long unsigned int)pte);
-    printk("Memory at this : 0x%012lx\n", (long unsigned int)pte->page_base_addr);
-#endif
+            /* Queued first, so the predicted reads overlap with ours */
+            petmem_count(map->stats, PETMEM_FAULT_MAJOR);
+            prefetch_predict(map, reg, PAGE_ADDR(fault_addr));
+            bad_signal += handle_swap_in(map, pte, PAGE_ADDR(fault_addr), 0);
+        }
+    }
+    if (static_branch_unlikely(&petmem_debug)) {
+        dump_fault_walk(fault_addr, error_code, pte);
+    }
+    up_read(&(map->vspace_sem));
     if(bad_signal){
         return -1;
     }
@@ -322,147 +1703,445 @@ int petmem_handle_pagefault(struct mem_map * map, uintptr_t fault_addr, u32 erro
 
 }
 
+int petmem_handle_pagefault(struct mem_map * map, uintptr_t fault_addr, u32 error_code) {
+    u64 start = ktime_get_ns();
+    int ret = handle_pagefault(map, fault_addr, error_code);
 
-void attempt_free_physical_address(uintptr_t address){
-    pte64_t * tables[4];
-    pte64_t * entries[4];
-    void * actual_mem;
-    int i;
-    /* If one of them isn't there, we don't need to free any physical address because there is none.*/
-    entries[3] = (pte64_t *) (CR3_TO_PML4E64_VA( get_cr3() ) + PML4E64_INDEX( address ) * 8);
-    tables[3] = (pte64_t *)(CR3_TO_PML4E64_VA(get_cr3()));
-    if(!entries[3]->present) {
-        return;
+    petmem_record_latency(map->stats, PETMEM_LAT_FAULT, ktime_get_ns() - start);
+    return ret;
+}
+
+
+/* Frames that came out of the range being emptied are held on to until the end,
+ * so the allocator has to offer something else. */
+struct evacuation {
+    uintptr_t start;
+    uintptr_t end;
+    uintptr_t * held;
+    unsigned long nr_held;
+    unsigned long max_held;
+};
+
+static uintptr_t evacuation_frame(struct evacuation * evac) {
+    uintptr_t frame;
+
+    while (evac->nr_held < evac->max_held) {
+        frame = petmem_alloc_pages(1);
+        if (frame == 0) {
+            return 0;
+        }
+        if (frame < evac->start || frame >= evac->end) {
+            return frame;
+        }
+        evac->held[evac->nr_held++] = frame;
     }
-    entries[2] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[3]->page_base_addr ) + (PDPE64_INDEX( address ) * 8)) ;
-    tables[2] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[3]->page_base_addr )) ;
-    if(!entries[2]->present) {
-        return;
+    return 0;
+}
+
+/* Moves the pages of one process out of the range, a TLB batch at a time: unmap,
+ * one shootdown, then copy and remap. Pages in flight are marked busy and taken off
+ * the list, so faults wait for them in handle_swap_in() and eviction leaves them
+ * alone while pt_lock is dropped. Called with vspace_sem held for read. */
+static int evacuate_map(struct mem_map * map, struct evacuation * evac) {
+    struct vp_node * nodes[TLB_BATCH_MAX];
+    uintptr_t targets[TLB_BATCH_MAX];
+    uintptr_t frame = evac->start;
+    uintptr_t old;
+    struct tlb_batch tlb;
+    struct vp_node * node;
+    pte64_t * pte;
+    int moved = 0;
+    int n, i;
+
+    spin_lock(&(map->pt_lock));
+    while (frame < evac->end) {
+        n = 0;
+        tlb_batch_init(&tlb, map->mm);
+
+        for (; frame < evac->end && n < TLB_BATCH_MAX; frame += PAGE_SIZE) {
+            if (petmem_frame_owner(frame, (void **)&node) != map) {
+                continue;
+            }
+            pte = (pte64_t *)node->pte;
+            /* Large pages fill a whole compaction region, there is never a reason to move one */
+            if (node->huge || !pte->present || BASE_TO_PAGE_ADDR(pte->page_base_addr) != frame) {
+                continue;
+            }
+            targets[n] = evacuation_frame(evac);
+            if (targets[n] == 0) {
+                /* Nowhere left to put pages, move what we have and stop */
+                frame = evac->end;
+                break;
+            }
+            clear_bit(PTE_PRESENT_BIT, PTE_WORD(pte));
+            pte->vmm_info = PTE_SWAPPED | PTE_BUSY;
+            list_del(&(node->list));
+            tlb_batch_add(&tlb, node->vaddr);
+            nodes[n++] = node;
+        }
+
+        if (n == 0) {
+            continue;
+        }
+        spin_unlock(&(map->pt_lock));
+        tlb_batch_flush(&tlb);
+
+        for (i = 0; i < n; i++) {
+            pte = (pte64_t *)nodes[i]->pte;
+            memcpy(__va(targets[i]), __va(BASE_TO_PAGE_ADDR(pte->page_base_addr)), PAGE_SIZE);
+        }
+
+        spin_lock(&(map->pt_lock));
+        for (i = 0; i < n; i++) {
+            pte = (pte64_t *)nodes[i]->pte;
+            old = BASE_TO_PAGE_ADDR(pte->page_base_addr);
+            petmem_set_frame_owner(old, NULL, NULL);
+            petmem_set_frame_owner(targets[i], map, nodes[i]);
+            /* accessed and dirty carry over, the MMU cannot have changed them since the flush */
+            pte->page_base_addr = PAGE_TO_BASE_ADDR(targets[i]);
+            pte->vmm_info = 0;
+            smp_wmb();
+            set_bit(PTE_PRESENT_BIT, PTE_WORD(pte));
+            list_add_tail(&(nodes[i]->list), &(map->clock_hand));
+            /* Straight back to the pool, a per-CPU cache would keep it from merging */
+            targets[i] = old;
+        }
+        spin_unlock(&(map->pt_lock));
+        wake_up_all(&(map->io_wait));
+
+        petmem_free_pages_bulk(targets, n);
+        moved += n;
+        spin_lock(&(map->pt_lock));
     }
+    spin_unlock(&(map->pt_lock));
 
-    entries[1] = (pte64_t *)__va(BASE_TO_PAGE_ADDR( entries[2]->page_base_addr ) + PDE64_INDEX( address )* 8);
-    tables[1] = (pte64_t *)__va(BASE_TO_PAGE_ADDR( entries[2]->page_base_addr ));
-    if(!entries[1]->present) {
-        return;
+    return moved;
+}
+
+int petmem_evacuate_range(uintptr_t start, uintptr_t end) {
+    struct evacuation evac;
+    struct mem_map * map;
+    int moved = 0;
+
+    evac.start = start;
+    evac.end = end;
+    evac.nr_held = 0;
+    evac.max_held = (end - start) >> PAGE_SHIFT;
+    evac.held = kmalloc(evac.max_held * sizeof(uintptr_t), GFP_KERNEL);
+    if (evac.held == NULL) {
+        return 0;
     }
 
-    entries[0] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[1]->page_base_addr ) + PTE64_INDEX( address ) * 8 );
-    tables[0] = (pte64_t *)__va( BASE_TO_PAGE_ADDR( entries[1]->page_base_addr ));
-    if(!entries[0]->present) {
-        return;
+    mutex_lock(&petmem_maps_mutex);
+    list_for_each_entry(map, &petmem_maps, maps) {
+        down_read(&(map->vspace_sem));
+        moved += evacuate_map(map, &evac);
+        up_read(&(map->vspace_sem));
     }
+    mutex_unlock(&petmem_maps_mutex);
 
-    actual_mem = (void *)__va( BASE_TO_PAGE_ADDR( entries[0]->page_base_addr ) + PHYSICAL_OFFSET( address ) );
-    petmem_free_pages((uintptr_t)actual_mem, 1);
-    for(i = 0; i < 4; i++){
-        pte64_t * cur = entries[i];
-        cur->writable = 0;
-        cur->user_page = 0;
-        cur->present = 0;
-        cur->page_base_addr = 0;
-		/* invalidate tlb entry for this page */
-        invlpg((uintptr_t) cur);
-        if(is_entire_page_free((void *) tables[i]) == PAGE_NOT_IN_USE){
-            printk("Table %d is being freed\n", i+1);
-            petmem_free_pages((uintptr_t) tables[i], 1);
-            invlpg((uintptr_t) tables[i]);
-        }
-        else{
-            return;
+    petmem_free_pages_bulk(evac.held, evac.nr_held);
+    kfree(evac.held);
+    return moved;
+}
+
+
+/* Table reclaim. A PT page whose entries are all swapped out or unused costs a frame
+ * and maps nothing, so it is written to swap and its PDE marked PTE_SWAPPED with the
+ * slot in page_base_addr; a PD whose PTs all went that way follows on a later pass.
+ * Faults bring tables back top down through populate_table(). Tables that hold
+ * nothing at all are simply freed. */
+#define TABLE_IN_USE  0
+#define TABLE_EMPTY   1
+#define TABLE_SWAPPED 2 /* only swapped out or unused entries */
+
+/* Tables of one process picked for swap, written out once the locks are dropped */
+struct table_reclaim {
+    struct mem_map * map;
+    struct list_head list;
+    unsigned int nr;
+    pte64_t * entries[UNMAP_BATCH_MAX];
+    uintptr_t tables[UNMAP_BATCH_MAX]; /* physical addresses */
+    u32 slots[UNMAP_BATCH_MAX];
+};
+
+static int reclaim_level(struct mem_map * map, pte64_t * table, int level,
+                         uintptr_t start, uintptr_t end, struct unmap_batch * ub, struct table_reclaim * tr) {
+    int shift = PAGE_SHIFT + (9 * level);
+    uintptr_t addr, next;
+    pte64_t * entry;
+    pte64_t * child;
+    int swapped = 0;
+    int state;
+    u32 index;
+    int i;
+
+    for (addr = start; addr < end && level > 0; addr = next) {
+        next = min(((addr >> shift) + 1) << shift, end);
+        entry = &table[(addr >> shift) & 0x1ff];
+
+        if (!entry->present || (level == 1 && ((pde64_t *)entry)->large_page)) {
+            continue;
         }
-    }}
 
-int is_entire_page_free(void * page_structure){
-    int i = 0;
-    for(i = 0; i < 512; i++){
-        int offset = i * 8;
-        pte64_t * page = (page_structure + offset);
-        if(page->present == 1){
-            return PAGE_IN_USE;
+        child = (pte64_t *)__va(BASE_TO_PAGE_ADDR(entry->page_base_addr));
+        state = reclaim_level(map, child, level - 1, addr, next, ub, tr);
+        if (!table_in_region(addr, shift) || state == TABLE_IN_USE) {
+            continue;
+        }
+
+        if (state == TABLE_SWAPPED) {
+            if (tr->nr == UNMAP_BATCH_MAX || swap_alloc_slot(map->swap, &index) != 0) {
+                continue;
+            }
+            /* Faults below wait in swap_in_table() until the write is done. Nothing
+             * below is present, so neither they nor the MMU can change the table. */
+            *(u64 *)entry = 0;
+            entry->page_base_addr = index;
+            entry->vmm_info = PTE_SWAPPED | PTE_BUSY;
+            tr->entries[tr->nr] = entry;
+            tr->tables[tr->nr] = __pa(child);
+            tr->slots[tr->nr++] = index;
+            tlb_batch_add_table(&(ub->tlb));
+            continue;
+        }
+
+        *(u64 *)entry = 0;
+        tlb_batch_add_table(&(ub->tlb));
+        ub->tables[ub->nr_tables++] = __pa(child);
+        if (ub->nr_tables == UNMAP_BATCH_MAX) {
+            unmap_batch_flush(map, ub);
+        }
+    }
+
+    for (i = 0; i < 512; i++) {
+        if (table[i].present || (table[i].vmm_info & PTE_BUSY)) {
+            return TABLE_IN_USE;
+        }
+        if (*(u64 *)&table[i] != 0) {
+            swapped = 1;
         }
     }
-    return PAGE_NOT_IN_USE;
+    return swapped ? TABLE_SWAPPED : TABLE_EMPTY;
 }
 
-void free_address(struct list_head * head_list, u64 page){ // Page is the address here
-	struct vaddr_reg * cur, * found, *next, *prev;
-    int i;
-	found = NULL;
-	list_for_each_entry(cur ,head_list, list){
-		if(cur->page_addr == page){
-		    found = cur;
+/* Called with vspace_sem held for read, faults on the rest of the process go on.
+ * A table that could not be written is put back as it was. Returns how many were written. */
+static int reclaim_write_tables(struct table_reclaim * tr) {
+    struct mem_map * map = tr->map;
+    pte64_t * entry;
+    int written = 0;
+    int failed;
+    unsigned int i;
+
+    for (i = 0; i < tr->nr; i++) {
+        entry = tr->entries[i];
+        failed = (map_swap_write(map, tr->slots[i], __va(tr->tables[i]), PHASE_BACKGROUND_IO) != 0);
+
+        spin_lock(&(map->pt_lock));
+        if (failed) {
+            *(u64 *)entry = 0;
+            entry->writable = 1;
+            entry->user_page = 1;
+            entry->page_base_addr = PAGE_TO_BASE_ADDR(tr->tables[i]);
+            smp_wmb();
+            entry->present = 1;
+        } else {
+            entry->vmm_info = PTE_SWAPPED;
+            map->table_pages--;
+            atomic_long_dec(&petmem_table_pages);
         }
-	}
-	if(found == NULL){
+        spin_unlock(&(map->pt_lock));
+        wake_up_all(&(map->io_wait));
+
+        if (failed) {
+            free_block(map->swap, tr->slots[i]);
+        } else {
+            petmem_free_pages(tr->tables[i], 1);
+            written++;
+        }
+    }
+    return written;
+}
+
+/* Tables are picked under petmem_maps_mutex and vspace_sem held for write, the writes
+ * happen after both are dropped to a read hold on vspace_sem, which keeps the process
+ * from being torn down under us. */
+int petmem_reclaim_tables(void) {
+    struct table_reclaim * tr, * next;
+    struct unmap_batch ub;
+    struct mem_map * map;
+    LIST_HEAD(pending);
+    int nr_swapped = 0;
+
+    mutex_lock(&petmem_maps_mutex);
+    list_for_each_entry(map, &petmem_maps, maps) {
+        tr = kmalloc(sizeof(struct table_reclaim), GFP_KERNEL);
+        if (tr == NULL) {
+            break;
+        }
+        /* A process that is busy faulting is clearly using its tables, try it next time */
+        if (!down_write_trylock(&(map->vspace_sem))) {
+            kfree(tr);
+            continue;
+        }
+        if (map->mm_gone) {
+            up_write(&(map->vspace_sem));
+            kfree(tr);
+            continue;
+        }
+        tr->map = map;
+        tr->nr = 0;
+
+        ub.nr_frames = 0;
+        ub.nr_tables = 0;
+        ub.nr_huge = 0;
+        tlb_batch_init(&(ub.tlb), map->mm);
+
+        write_seqlock(&(map->walk_lock));
+        memset(&(map->walk), 0, sizeof(struct walk_cache));
+        write_sequnlock(&(map->walk_lock));
+        map->fa.ptes = NULL;
+
+        reclaim_level(map, (pte64_t *)map->mm->pgd, 3, PETMEM_REGION_START, PETMEM_REGION_END, &ub, tr);
+        unmap_batch_flush(map, &ub);
+
+        if (tr->nr == 0) {
+            up_write(&(map->vspace_sem));
+            kfree(tr);
+            continue;
+        }
+        downgrade_write(&(map->vspace_sem));
+        list_add_tail(&(tr->list), &pending);
+    }
+    mutex_unlock(&petmem_maps_mutex);
+
+    list_for_each_entry_safe(tr, next, &pending, list) {
+        nr_swapped += reclaim_write_tables(tr);
+        up_read(&(tr->map->vspace_sem));
+        kfree(tr);
+    }
+
+    return nr_swapped;
+}
+
+
+void free_address(struct mem_map * map, u64 page){ // Page is the address here
+	struct vaddr_reg * found, * next, * prev;
+	struct rb_node * rb;
+
+	found = region_lookup(map, page);
+	if(found == NULL || found->page_addr != page || found->status != ALLOCATED){
 		return;
 	}
 	//Remove actually allocated pages here.
-    for( i = 0; i < found->size; i++){
-        attempt_free_physical_address(found->page_addr + (i * 4096));
-
-    }
+	unmap_range(map, found->page_addr, found->page_addr + (found->size << PAGE_POWER_4KB));
 	//Set the clear values.
 	found->status = FREE;
-    for(i = 0; i < found->size; i++){
-
-        invlpg(found->page_addr + (i * 4096)); // NOTE: Remember that you must notify the hardware with invlpg whenever you modify a
-                                               //page entry that might have been cached in the TLB.
-    }
+	/* The cached region may be about to be merged away */
+	map->last_hit = NULL;
 
 	//Coalesce nodes.
-	next = list_entry(found->list.next, struct vaddr_reg, list);
-	prev = list_entry(found->list.prev, struct vaddr_reg, list);
-
-	if(next->page_addr != page && next->status == FREE){
-		list_del(found->list.next); // We will delete the next because FREE next was generated from this current node
+	rb = rb_next(&(found->addr_node));
+	next = rb ? rb_entry(rb, struct vaddr_reg, addr_node) : NULL;
+	if(next != NULL && next->status == FREE){
+		rb_erase(&(next->size_node), &(map->free_regions));
+		rb_erase(&(next->addr_node), &(map->regions));
 		found->size += next->size;
 		kfree(next);
 	}
-	if(prev->page_addr != page && prev->status == FREE){  // prev allocated first then current allocated. prev freed first then now current is freeing
-        found->page_addr = prev->page_addr;
-		list_del(found->list.prev);
-		found->size += prev->size;
-		kfree(prev);
+
+	rb = rb_prev(&(found->addr_node));
+	prev = rb ? rb_entry(rb, struct vaddr_reg, addr_node) : NULL;
+	if(prev != NULL && prev->status == FREE){  // prev allocated first then current allocated. prev freed first then now current is freeing
+		/* prev keeps its place in the address tree, it only grows */
+		rb_erase(&(prev->size_node), &(map->free_regions));
+		rb_erase(&(found->addr_node), &(map->regions));
+		prev->size += found->size;
+		kfree(found);
+		found = prev;
 	}
 
+	free_region_insert(map, found);
 }
 
 /* petmem_ioctl() calls petmem_alloc_vspace() using LAZY_ALLOC, which calls this allocate(),
  * and the 1st parameter passed in is that new_proc. */
-uintptr_t  allocate(struct list_head * head_list, u64 size){  // head_list is new_proc->memory_allocations and size is num of pages
-	struct vaddr_reg *cur, *node_to_consume, *new_node;
+/* Splits the unaligned head off a free region as a free region of its own */
+static int region_align(struct mem_map * map, struct vaddr_reg * reg, u64 align) {
+	struct vaddr_reg * head;
+	u64 lead = (ALIGN(reg->page_addr, align) - reg->page_addr) >> PAGE_POWER_4KB;
+
+	if(lead == 0){
+		return 0;
+	}
+	head = (struct vaddr_reg *)kmalloc(sizeof(struct vaddr_reg), GFP_KERNEL);
+	if(head == NULL){
+		return -1;
+	}
+
+	rb_erase(&(reg->size_node), &(map->free_regions));
+	head->status = FREE;
+	head->page_addr = reg->page_addr;
+	head->size = lead;
+	/* reg keeps its place in the address tree, nothing lies between it and head */
+	reg->page_addr += lead << PAGE_POWER_4KB;
+	reg->size -= lead;
+
+	region_insert(map, head);
+	free_region_insert(map, head);
+	free_region_insert(map, reg);
+	return 0;
+}
+
+uintptr_t  allocate(struct mem_map * map, u64 size){  // size is num of pages
+	struct vaddr_reg *node_to_consume, *new_node = NULL;
 	u64 current_size;
+
+	/* large regions start on a 2 MB boundary so they can be mapped with large pages,
+	 * if there is room for the alignment. */
 	node_to_consume = NULL;
-	/* traverse map->memory_allocations, find one whose status is FREE. */
-	list_for_each_entry(cur, head_list, list){  // cur = position; head_list = head of the list; list = name of the list_head within the struct.
-		if(cur->status == FREE && cur->size >= size){
-			node_to_consume = cur;
-			break;
+	if(size >= HUGE_PAGE_PAGES){
+		node_to_consume = region_best_fit(map, size + HUGE_PAGE_PAGES - 1);
+		if(node_to_consume != NULL && region_align(map, node_to_consume, HUGE_PAGE_SIZE) != 0){
+			node_to_consume = NULL;
 		}
 	}
-	/* if no nodes is free and has a size larger than the requested size, then return -1. */
+	/* the smallest free region that fits */
 	if(node_to_consume == NULL){
-		return -1;
+		node_to_consume = region_best_fit(map, size);
+	}
+	/* if no free region is large enough, return 0, which the caller reports as a failure. */
+	if(node_to_consume == NULL){
+		return 0;
+	}
+
+	if(node_to_consume->size != size){
+		new_node = (struct vaddr_reg*)kmalloc(sizeof(struct vaddr_reg), GFP_KERNEL);
+		if(new_node == NULL){
+			return 0;
+		}
 	}
 
-	printk("Node to break apart: %p\n", (void *)node_to_consume->page_addr);
+	petmem_dbg("Node to break apart: %p\n", (void *)node_to_consume->page_addr);
+	rb_erase(&(node_to_consume->size_node), &(map->free_regions));
 	node_to_consume->status = ALLOCATED;
+	memset(&(node_to_consume->stream), 0, sizeof(struct fault_stream));
 	if(node_to_consume->size == size){
 		return node_to_consume->page_addr;
 	}
 
 	current_size = node_to_consume->size;
 	current_size -= size;
-	new_node = (struct vaddr_reg*)kmalloc(sizeof(struct vaddr_reg), GFP_KERNEL);
-	INIT_LIST_HEAD(&(new_node->list));
-	/* add new_node->list to the existing list. */
-	list_add(&(new_node->list), &(node_to_consume->list));
 	new_node->size = current_size;
 	new_node->page_addr = node_to_consume->page_addr + (size << PAGE_POWER_4KB);
 	new_node->status = FREE;
+	/* add new_node to both trees, node_to_consume keeps its place since its address did not change. */
+	region_insert(map, new_node);
+	free_region_insert(map, new_node);
 
 	node_to_consume->size = size;
-	/* so basically we add new_node to the list and keep both new_node and node_to_consume,
+	/* so basically we add new_node to the trees and keep both new_node and node_to_consume,
 	 * but we return node_to_consume->page_addr to the caller. note that the size of node_to_consumer is deducted,
 	 * and we keep the remainder in new_node. */
 	return node_to_consume->page_addr;
@@ -477,14 +2156,7 @@ void print_bits(u64 * num){
     }
 }
 int check_address_range(struct mem_map * map, uintptr_t address){
- 	struct vaddr_reg * cur;
-	list_for_each_entry(cur, &(map->memory_allocations), list){
-        if(cur->status == ALLOCATED && address >= cur->page_addr && address < (cur->page_addr + 4096 * cur->size)){
-            return ALLOCATED_ADDRESS_RANGE;
-        }
-	}
-    return NOT_VALID_RANGE;
-
+    return (fault_region(map, address) != NULL) ? ALLOCATED_ADDRESS_RANGE : NOT_VALID_RANGE;
 }
 
 /* vim: set ts=4: */
@@ -8,50 +8,159 @@
 
 #include <linux/module.h>
 #include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/rwsem.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
+#include <linux/workqueue.h>
+#include <linux/seqlock.h>
+#include <linux/mmu_notifier.h>
 #include "swap.h"
+#include "tlb.h"
+#include "stats.h"
 #define ALLOCATED 0
 #define PHYSICALLY_ALLOCATED 1
+
+/* Software state kept in pte64_t.vmm_info (bits 9-11, ignored by the MMU).
+ * The hardware accessed and dirty bits are left alone so eviction can use them. */
+#define PTE_SWAPPED 0x1 /* Not present, page_base_addr holds the swap slot index */
+#define PTE_BUSY    0x2 /* Swap I/O on this page is in flight, faulting threads wait for it */
+
+#define PTE_IS_SWAPPED(pte) ((pte)->vmm_info & PTE_SWAPPED)
+
+/* In a non-present PDE or PDPE, PTE_SWAPPED means the table below was swapped out
+ * (see petmem_reclaim_tables()) and PTE_BUSY that it is being written or read back. */
+
+/* How far FIFO looks past the head of the queue for a page that needs no write-back */
+#define CLEAN_SCAN_LIMIT 32
+/* Swap-in faults of one region, for stride detection. Under pt_lock. */
+struct fault_stream {
+    u64 last;     /* page of the last swap-in fault, 0 before the first */
+    s64 stride;   /* distance from the one before, in bytes */
+    u32 repeats;  /* how many times in a row stride repeated */
+};
+
 struct vaddr_reg {
    /* You can use this to demarcate virtual address allocations */
 	u8 status;
 	u64 size;
 	u64 page_addr;
-	struct list_head list;
+	struct fault_stream stream; /* ALLOCATED regions only */
+	struct rb_node addr_node; /* in mem_map.regions, every region */
+	struct rb_node size_node; /* in mem_map.free_regions, FREE regions only */
 };
 
+struct pde64;
+struct pte64;
+
+/* Tables of the last fault, so the next one in the same 1 GB or 2 MB skips the upper levels.
+ * An address of 0 is never in the petmem range and marks an empty slot. */
+struct walk_cache {
+    uintptr_t pd_vaddr;  /* 1 GB aligned */
+    struct pde64 * pd;
+    uintptr_t pt_vaddr;  /* 2 MB aligned */
+    struct pte64 * pt;
+};
+
+/* Fault-around: a compulsory fault also maps up to window empty pages after it.
+ * The pages mapped last time are graded by their accessed bits at the next
+ * compulsory fault, and the window grows or shrinks accordingly. */
+struct fault_around {
+    struct pte64 * ptes;  /* first PTE of the last window, NULL if there is none to grade */
+    unsigned int nr;      /* pages mapped in it */
+    unsigned int window;
+};
+
+/*
+ * Locking:
+ *   vspace_sem  the region trees. Held for read across a whole page fault and
+ *               for write by allocate/free/teardown, so page tables cannot be
+ *               torn down under a fault.
+ *   pt_lock     page table entries and clock_hand. Never held across swap I/O
+ *               or a sleeping allocation; PTE_BUSY marks a page whose I/O is
+ *               running unlocked, and io_wait is woken when it completes.
+ *               table_pages is updated under pt_lock by faults and with
+ *               vspace_sem held for write by unmaps.
+ *   walk_lock   the walk cache. Faults read and fill it holding vspace_sem for
+ *               read; tables are only freed with vspace_sem held for write.
+ *   petmem_maps_mutex
+ *               the list of all processes. Compaction holds it while it moves
+ *               frames, so a process cannot be torn down under it.
+ * Lock order: petmem_maps_mutex -> vspace_sem -> pt_lock -> swap_space.lock ->
+ *             buddy pool locks.
+ *
+ * Every resident data frame has its mem_map and vp_node as frame owner (see
+ * petmem_set_frame_owner()), set and cleared under pt_lock or vspace_sem held for
+ * write, so with both held for a process its owner entries are stable.
+ */
 struct mem_map {
    /* Add your own state here */
-	struct list_head memory_allocations;
+	struct rb_root regions;      /* the whole petmem range, tiled by regions, keyed by address */
+	struct rb_root free_regions; /* FREE regions keyed by size then address, for best fit */
+	struct vaddr_reg * last_hit; /* region of the last fault, checked before the tree */
+	seqlock_t walk_lock;
+	struct walk_cache walk;
+	unsigned long table_pages;   /* page table pages taken from the petmem pools */
+	struct fault_around fa;      /* under pt_lock */
+	unsigned long swapin_faults;   /* under pt_lock, as are the prefetch counters */
+	unsigned long prefetch_issued; /* pages read in ahead of a fault */
+	unsigned long prefetch_hits;   /* ... that were then used */
+	atomic_t prefetch_pending;     /* requests queued, see prefetch_predict() */
+	struct petmem_stats __percpu * stats; /* this process' share of the debugfs statistics */
+	struct dentry * stats_file;
     struct list_head clock_hand;
     struct swap_space * swap;
     char * policy_name;
+
+    struct mm_struct * mm; /* address space the regions live in, for TLB shootdowns */
+    struct mmu_notifier mn; /* empties the petmem range before exit_mmap() frees the tables, see petmem_mm_release() */
+    int mm_gone;            /* under vspace_sem, the range was emptied and the tables may be gone */
+
+    struct rw_semaphore vspace_sem;
+    spinlock_t pt_lock;
+    wait_queue_head_t io_wait;
+
+    struct list_head maps; /* on the list of all processes, for compaction */
+    struct work_struct teardown;
 };
 
 struct vp_node {
     void * pte;
+    uintptr_t vaddr;
+    u32 swap_index; /* slot holding a copy of the page, valid if swap_valid */
+    u8 swap_valid;  /* page was swapped in and the slot was kept */
+    u8 huge;        /* pte is a PDE mapping a 2 MB large page, vaddr is 2 MB aligned */
+    u8 prefetched;  /* read in ahead of a fault and not seen accessed yet */
     struct list_head list;
 };
 
 struct mem_map * petmem_init_process(void);
+// Queues the teardown of a process, petmem_workqueues_exit() waits for all of them.
 void petmem_deinit_process(struct mem_map * map);
+int petmem_workqueues_init(void);
+void petmem_workqueues_exit(void);
 
 uintptr_t petmem_alloc_vspace(struct mem_map * map, u64 num_pages);
 void petmem_free_vspace(struct mem_map * map, uintptr_t vaddr);
 
-int handle_table_memory(void * mem, struct mem_map * map);
+int handle_table_memory(void * mem, struct mem_map * map, uintptr_t vaddr);
 void petmem_dump_vspace(struct mem_map * map);
+struct vspace_stats;
+void petmem_vspace_stats(struct mem_map * map, struct vspace_stats * stats);
 
-//Put page in the void *, return -1 if the page is not valid (FREE or not allocated).
-void clear_up_memory(struct mem_map * map, void * new_pte);
-void * page_replacement_clock(struct mem_map * map,  void ** mem, void * new_pte);
-void * page_replacement_fifo(struct mem_map * map,  void ** mem, void * new_pte);
-uintptr_t get_valid_page_entry(uintptr_t address);
+// Evicts one resident page. Returns 0 if a frame was released, -1 if nothing could be evicted.
+int clear_up_memory(struct mem_map * map);
+struct vp_node * page_replacement_clock(struct mem_map * map);
+struct vp_node * page_replacement_fifo(struct mem_map * map);
+int page_needs_write(struct vp_node * node);
 
 int petmem_handle_pagefault(struct mem_map * map, uintptr_t fault_addr, u32 error_code);
+// Moves every movable page mapped from frames in [start, end) elsewhere. Returns how many moved.
+int petmem_evacuate_range(uintptr_t start, uintptr_t end);
+// Swaps out page tables that map nothing resident. Returns how many were written to swap.
+int petmem_reclaim_tables(void);
 void print_bits(u64* num);
-void free_address(struct list_head * head_list, u64 page);
-void attempt_free_physical_address(uintptr_t address);
-int is_entire_page_free(void * page_structure);
+void free_address(struct mem_map * map, u64 page);
 int check_address_range(struct mem_map * map, uintptr_t address);
-uintptr_t allocate(struct list_head * head_list, u64 size);
+uintptr_t allocate(struct mem_map * map, u64 size);
 #endif
@@ -3,6 +3,9 @@
  * (c) Jack Lange, 2012
  */
 
+#ifndef __PETMEM_H__
+#define __PETMEM_H__
+
 #ifndef __KERNEL__
 char * dev_file = "/dev/petmem";
 #endif
@@ -27,6 +30,65 @@ struct page_fault {
     unsigned int error_code;
 } __attribute__((packed));
 
+struct pool_stats {
+    // input
+    unsigned int pool_id;
+
+    // output
+    unsigned long long base_addr;
+    unsigned long long pages;
+    unsigned long long free_pages;
+    unsigned int frag_index;   /* 0-1000, how much free memory is unusable for huge page sized blocks */
+    unsigned int node;
+} __attribute__((packed));
+
+struct node_stats {
+    // input
+    unsigned int node;
+
+    // output
+    unsigned long long pages;
+    unsigned long long free_pages;
+    unsigned long long local_allocs;   /* frames handed to CPUs of this node from its own pools */
+    unsigned long long remote_allocs;  /* ... and from other nodes' pools */
+} __attribute__((packed));
+
+struct vspace_stats {
+    // output
+    unsigned long long table_pages;        /* page table pages of this process, taken from petmem pools */
+    unsigned long long table_pages_total;  /* ... of every process */
+    unsigned long long swapin_faults;      /* faults that had to read a page from swap */
+    unsigned long long prefetch_issued;    /* pages read from swap ahead of a fault */
+    unsigned long long prefetch_hits;      /* ... that were used; accuracy is hits / issued,
+                                              coverage hits / (hits + swapin_faults) */
+} __attribute__((packed));
+
+struct buddy_bench {
+    // output
+    unsigned long long pairs;          /* single page alloc/free pairs run on a scratch pool */
+    unsigned long long alloc_cycles;   /* average TSC cycles per buddy_alloc() */
+    unsigned long long free_cycles;    /* ... per buddy_free(), frees come in shuffled order */
+} __attribute__((packed));
+
+/* Phases of fault handling, timed with the TSC. They do not overlap: evictions a
+ * frame allocation has to do count as victim selection and swap out only. Swap I/O
+ * that no fault waits for goes to its own bucket. */
+#define PHASE_REGION_LOOKUP 0  /* finding the region of the faulting address */
+#define PHASE_TABLE_WALK    1  /* walking the page tables to the PTE, creating missing tables */
+#define PHASE_FRAME_ALLOC   2  /* getting frames, small or large, from the pools and zeroing them */
+#define PHASE_VICTIM_SELECT 3  /* choosing a page to evict */
+#define PHASE_SWAP_OUT      4  /* writing a page or table to swap */
+#define PHASE_SWAP_IN       5  /* reading a page or table from swap */
+#define PHASE_BACKGROUND_IO 6  /* swap I/O outside of faults: prefetch, table reclaim, unmap */
+#define NR_PHASES           7
+
+struct phase_stats {
+    // output
+    unsigned long long cycles[NR_PHASES];  /* TSC cycles spent in each phase, by this process */
+    unsigned long long calls[NR_PHASES];   /* how many times each phase ran */
+    unsigned long long tsc_khz;            /* cycles per millisecond, to turn cycles into time */
+} __attribute__((packed));
+
 
 // IOCTLs
 #define ADD_MEMORY     1
@@ -38,10 +100,17 @@ struct page_fault {
 #define LAZY_ALLOC     30
 #define LAZY_FREE      31
 #define LAZY_DUMP_STATE 32
+#define VSPACE_STATS   33
+#define PHASE_STATS    34
 
 #define PAGE_FAULT     50
 #define INVALIDATE_PAGE 51
 
+#define POOL_STATS     60
+#define COMPACT_MEMORY 61
+#define NODE_STATS     62
+#define BUDDY_BENCH    63
+
 
 
 #ifdef __KERNEL__
@@ -57,6 +126,20 @@ struct page_fault {
 
 
 
+#include <linux/jump_label.h>
+
+/* Diagnostic output is off unless the module is loaded with debug=1, or 1 is written to
+ * /sys/module/petmem/parameters/debug. While off it costs one patched out jump. */
+DECLARE_STATIC_KEY_FALSE(petmem_debug);
+
+#define petmem_dbg(fmt, ...)						\
+    do {								\
+	if (static_branch_unlikely(&petmem_debug)) {			\
+	    printk(KERN_DEBUG fmt, ##__VA_ARGS__);			\
+	}								\
+    } while (0)
+
+
 // Returns the current CR3 value
 static inline uintptr_t get_cr3(void) {
     u64 cr3 = 0;
@@ -70,8 +153,7 @@ static inline uintptr_t get_cr3(void) {
 }
 
 
-static inline void invlpg(uintptr_t page_addr) {
-    printk("Invalidating Address %p\n", (void *)page_addr);
+static inline void __invlpg(uintptr_t page_addr) {
     __asm__ __volatile__ ("invlpg (%0); "
 			  : 
 			  :"r"(page_addr)
@@ -79,11 +161,46 @@ static inline void invlpg(uintptr_t page_addr) {
 			  );
 }
 
+static inline void invlpg(uintptr_t page_addr) {
+    petmem_dbg("Invalidating Address %p\n", (void *)page_addr);
+    __invlpg(page_addr);
+}
+
+// Zeroes a 4KB page with non-temporal stores, so zeroing does not push anything out of the caches
+static inline void clear_page_nt(void * page) {
+    __asm__ __volatile__ ("xorl %%eax, %%eax; "
+			  "movl $128, %%ecx; "
+			  "1: movnti %%rax, (%0); "
+			  "movnti %%rax, 8(%0); "
+			  "movnti %%rax, 16(%0); "
+			  "movnti %%rax, 24(%0); "
+			  "addq $32, %0; "
+			  "decl %%ecx; "
+			  "jnz 1b; "
+			  "sfence; "
+			  : "+r"(page)
+			  :
+			  : "rax", "rcx", "memory"
+			  );
+}
+
 
 
 #include <linux/types.h>
 
 uintptr_t petmem_alloc_pages(u64 num_pages);
+uintptr_t petmem_try_alloc_pages(u64 num_pages);
 void petmem_free_pages(uintptr_t page_addr, u64 num_pages);
+unsigned long petmem_drain_cached_frames(void);
+
+unsigned long petmem_alloc_pages_bulk(uintptr_t * frames, unsigned long count);
+unsigned long petmem_alloc_zeroed_pages(uintptr_t * frames, unsigned long count);
+void petmem_free_pages_bulk(uintptr_t * frames, unsigned long count);
+unsigned long long petmem_pool_free_pages(void);
+
+void petmem_set_frame_owner(uintptr_t frame, void * owner, void * owner_data);
+void * petmem_frame_owner(uintptr_t frame, void ** owner_data);
+
+#endif
 
 #endif
@@ -0,0 +1,121 @@
+/* Tracepoints of the petmem fault path, they cost nothing until enabled:
+ *   echo 1 > /sys/kernel/debug/tracing/events/petmem/enable
+ * or perf record -e 'petmem:*'
+ */
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM petmem
+
+#if !defined(__PETMEM_TRACE_H__) || defined(TRACE_HEADER_MULTI_READ)
+#define __PETMEM_TRACE_H__
+
+#include <linux/tracepoint.h>
+
+
+TRACE_EVENT(petmem_fault,
+	    TP_PROTO(unsigned long vaddr, u32 error_code),
+	    TP_ARGS(vaddr, error_code),
+
+	    TP_STRUCT__entry(
+		__field(unsigned long, vaddr)
+		__field(u32, error_code)
+		),
+
+	    TP_fast_assign(
+		__entry->vaddr = vaddr;
+		__entry->error_code = error_code;
+		),
+
+	    TP_printk("vaddr=0x%012lx error=%u", __entry->vaddr, __entry->error_code)
+    );
+
+TRACE_EVENT(petmem_evict,
+	    TP_PROTO(unsigned long vaddr, u32 index, int written),
+	    TP_ARGS(vaddr, index, written),
+
+	    TP_STRUCT__entry(
+		__field(unsigned long, vaddr)
+		__field(u32, index)
+		__field(int, written)
+		),
+
+	    TP_fast_assign(
+		__entry->vaddr = vaddr;
+		__entry->index = index;
+		__entry->written = written;
+		),
+
+	    TP_printk("vaddr=0x%012lx slot=%u written=%d", __entry->vaddr, __entry->index, __entry->written)
+    );
+
+TRACE_EVENT(petmem_swap_in,
+	    TP_PROTO(unsigned long vaddr, u32 index, int prefetch),
+	    TP_ARGS(vaddr, index, prefetch),
+
+	    TP_STRUCT__entry(
+		__field(unsigned long, vaddr)
+		__field(u32, index)
+		__field(int, prefetch)
+		),
+
+	    TP_fast_assign(
+		__entry->vaddr = vaddr;
+		__entry->index = index;
+		__entry->prefetch = prefetch;
+		),
+
+	    TP_printk("vaddr=0x%012lx slot=%u prefetch=%d", __entry->vaddr, __entry->index, __entry->prefetch)
+    );
+
+TRACE_EVENT(petmem_swap_out,
+	    TP_PROTO(u32 index),
+	    TP_ARGS(index),
+
+	    TP_STRUCT__entry(
+		__field(u32, index)
+		),
+
+	    TP_fast_assign(
+		__entry->index = index;
+		),
+
+	    TP_printk("slot=%u", __entry->index)
+    );
+
+/* Allocations and frees share a layout */
+DECLARE_EVENT_CLASS(petmem_frames,
+		    TP_PROTO(unsigned long paddr, u64 num_pages),
+		    TP_ARGS(paddr, num_pages),
+
+		    TP_STRUCT__entry(
+			__field(unsigned long, paddr)
+			__field(u64, num_pages)
+			),
+
+		    TP_fast_assign(
+			__entry->paddr = paddr;
+			__entry->num_pages = num_pages;
+			),
+
+		    TP_printk("paddr=0x%012lx pages=%llu", __entry->paddr, __entry->num_pages)
+    );
+
+DEFINE_EVENT(petmem_frames, petmem_alloc,
+	     TP_PROTO(unsigned long paddr, u64 num_pages),
+	     TP_ARGS(paddr, num_pages)
+    );
+
+DEFINE_EVENT(petmem_frames, petmem_free,
+	     TP_PROTO(unsigned long paddr, u64 num_pages),
+	     TP_ARGS(paddr, num_pages)
+    );
+
+#endif
+
+/* Lives next to the sources rather than in include/trace/events */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE petmem_trace
+
+#include <trace/define_trace.h>
@@ -0,0 +1,243 @@
+/* Fault path counters and latency histograms, exported through debugfs */
+
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/atomic.h>
+
+#include "petmem.h"
+#include "stats.h"
+
+
+DEFINE_PER_CPU(struct petmem_stats, petmem_global_stats);
+
+static struct dentry * petmem_debugfs_dir = NULL;
+static struct dentry * petmem_debugfs_procs = NULL;
+
+/* Tells apart the files of a process that opened /dev/petmem more than once */
+static atomic_t petmem_stats_seq = ATOMIC_INIT(0);
+
+static const char * event_names[PETMEM_NR_EVENTS] = {
+    [PETMEM_FAULT_COMPULSORY] = "compulsory_faults",
+    [PETMEM_FAULT_MAJOR]      = "major_faults",
+    [PETMEM_EVICT_CLOCK]      = "evictions_clock",
+    [PETMEM_EVICT_FIFO]       = "evictions_fifo",
+    [PETMEM_SWAP_READ]        = "swap_reads",
+    [PETMEM_SWAP_WRITE]       = "swap_writes",
+    [PETMEM_PREFETCH_HIT]     = "prefetch_hits",
+};
+
+static const char * latency_names[PETMEM_NR_LATENCIES] = {
+    [PETMEM_LAT_FAULT]   = "fault_latency_ns",
+    [PETMEM_LAT_SWAP_IO] = "swap_io_latency_ns",
+};
+
+static const char * phase_names[NR_PHASES] = {
+    [PHASE_REGION_LOOKUP] = "region_lookup",
+    [PHASE_TABLE_WALK]    = "table_walk",
+    [PHASE_FRAME_ALLOC]   = "frame_alloc",
+    [PHASE_VICTIM_SELECT] = "victim_select",
+    [PHASE_SWAP_OUT]      = "swap_out",
+    [PHASE_SWAP_IN]       = "swap_in",
+    [PHASE_BACKGROUND_IO] = "background_io",
+};
+
+
+static void stats_sum(struct petmem_stats __percpu * stats, struct petmem_stats * sum) {
+    struct petmem_stats * cpu_stats = NULL;
+    int cpu = 0;
+    int i = 0;
+    int j = 0;
+
+    memset(sum, 0, sizeof(struct petmem_stats));
+
+    /* The counters are not read atomically with each other, a scrape may see one fault half counted */
+    for_each_possible_cpu(cpu) {
+	cpu_stats = per_cpu_ptr(stats, cpu);
+
+	for (i = 0; i < PETMEM_NR_EVENTS; i++) {
+	    sum->events[i] += READ_ONCE(cpu_stats->events[i]);
+	}
+
+	for (i = 0; i < PETMEM_NR_LATENCIES; i++) {
+	    for (j = 0; j < PETMEM_LAT_BUCKETS; j++) {
+		sum->latency[i][j] += READ_ONCE(cpu_stats->latency[i][j]);
+	    }
+	}
+
+	for (i = 0; i < NR_PHASES; i++) {
+	    sum->phase_cycles[i] += READ_ONCE(cpu_stats->phase_cycles[i]);
+	    sum->phase_calls[i] += READ_ONCE(cpu_stats->phase_calls[i]);
+	}
+    }
+}
+
+/* One "name value" line per counter, then one "name lower_bound count" line per
+ * non-empty histogram bucket, then "phase_cycles name cycles calls" for the phases that ran */
+static void stats_show(struct seq_file * s, struct petmem_stats * sum) {
+    int i = 0;
+    int j = 0;
+
+    for (i = 0; i < PETMEM_NR_EVENTS; i++) {
+	seq_printf(s, "%s %llu\n", event_names[i], sum->events[i]);
+    }
+
+    for (i = 0; i < PETMEM_NR_LATENCIES; i++) {
+	for (j = 0; j < PETMEM_LAT_BUCKETS; j++) {
+	    if (sum->latency[i][j] != 0) {
+		seq_printf(s, "%s %llu %llu\n", latency_names[i], 1ULL << j, sum->latency[i][j]);
+	    }
+	}
+    }
+
+    for (i = 0; i < NR_PHASES; i++) {
+	if (sum->phase_calls[i] != 0) {
+	    seq_printf(s, "phase_cycles %s %llu %llu\n", phase_names[i], sum->phase_cycles[i], sum->phase_calls[i]);
+	}
+    }
+}
+
+/* The counters of one set to the kernel log, for LAZY_DUMP_STATE */
+void petmem_stats_dump(struct petmem_stats __percpu * stats) {
+    struct petmem_stats * sum = kmalloc(sizeof(struct petmem_stats), GFP_KERNEL);
+    int i = 0;
+
+    if (sum == NULL) {
+	return;
+    }
+
+    stats_sum(stats, sum);
+    for (i = 0; i < PETMEM_NR_EVENTS; i++) {
+	printk("%s: %llu\n", event_names[i], sum->events[i]);
+    }
+
+    kfree(sum);
+}
+
+void petmem_stats_phases(struct petmem_stats __percpu * stats, struct phase_stats * phases) {
+    struct petmem_stats * sum = kmalloc(sizeof(struct petmem_stats), GFP_KERNEL);
+    int i = 0;
+
+    memset(phases, 0, sizeof(struct phase_stats));
+
+    if (sum == NULL) {
+	return;
+    }
+
+    stats_sum(stats, sum);
+    for (i = 0; i < NR_PHASES; i++) {
+	phases->cycles[i] = sum->phase_cycles[i];
+	phases->calls[i] = sum->phase_calls[i];
+    }
+
+    kfree(sum);
+}
+
+static int global_stats_show(struct seq_file * s, void * unused) {
+    struct petmem_stats * sum = kmalloc(sizeof(struct petmem_stats), GFP_KERNEL);
+
+    if (sum == NULL) {
+	return -ENOMEM;
+    }
+
+    stats_sum(&petmem_global_stats, sum);
+    stats_show(s, sum);
+    seq_printf(s, "pool_free_pages %llu\n", petmem_pool_free_pages());
+
+    kfree(sum);
+    return 0;
+}
+
+static int process_stats_show(struct seq_file * s, void * unused) {
+    struct petmem_stats * sum = kmalloc(sizeof(struct petmem_stats), GFP_KERNEL);
+
+    if (sum == NULL) {
+	return -ENOMEM;
+    }
+
+    stats_sum((struct petmem_stats __percpu *)s->private, sum);
+    stats_show(s, sum);
+
+    kfree(sum);
+    return 0;
+}
+
+static int global_stats_open(struct inode * inode, struct file * filp) {
+    return single_open(filp, global_stats_show, NULL);
+}
+
+static int process_stats_open(struct inode * inode, struct file * filp) {
+    return single_open(filp, process_stats_show, inode->i_private);
+}
+
+static const struct file_operations global_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = global_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+static const struct file_operations process_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = process_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+
+/* Statistics are not worth failing the module load over, without debugfs they are simply not exported */
+int petmem_stats_init(void) {
+    petmem_debugfs_dir = debugfs_create_dir("petmem", NULL);
+
+    if (IS_ERR_OR_NULL(petmem_debugfs_dir)) {
+	printk("Could not create the petmem debugfs directory, statistics are not exported\n");
+	petmem_debugfs_dir = NULL;
+	return 0;
+    }
+
+    debugfs_create_file("stats", 0444, petmem_debugfs_dir, NULL, &global_stats_fops);
+    petmem_debugfs_procs = debugfs_create_dir("procs", petmem_debugfs_dir);
+
+    if (IS_ERR(petmem_debugfs_procs)) {
+	petmem_debugfs_procs = NULL;
+    }
+
+    return 0;
+}
+
+void petmem_stats_exit(void) {
+    debugfs_remove_recursive(petmem_debugfs_dir);
+    petmem_debugfs_dir = NULL;
+    petmem_debugfs_procs = NULL;
+}
+
+
+struct petmem_stats __percpu * petmem_stats_alloc(void) {
+    return alloc_percpu(struct petmem_stats);
+}
+
+void petmem_stats_free(struct petmem_stats __percpu * stats) {
+    free_percpu(stats);
+}
+
+struct dentry * petmem_stats_add_process(struct petmem_stats __percpu * stats, pid_t pid) {
+    struct dentry * file = NULL;
+    char name[32];
+
+    if (petmem_debugfs_procs == NULL) {
+	return NULL;
+    }
+
+    snprintf(name, sizeof(name), "%d-%d", pid, atomic_inc_return(&petmem_stats_seq));
+    file = debugfs_create_file(name, 0444, petmem_debugfs_procs, (void *)stats, &process_stats_fops);
+
+    return IS_ERR(file) ? NULL : file;
+}
+
+/* Waits for readers of the file, so the set can be freed afterwards */
+void petmem_stats_remove_process(struct dentry * file) {
+    debugfs_remove(file);
+}
@@ -0,0 +1,90 @@
+/* Fault path counters and latency histograms
+ *
+ * Every process has its own set, and a module-wide set sums all processes.
+ * Both are per CPU, so the fault path bumps them without locks or shared cache
+ * lines; readers add up the CPUs. Exported through debugfs:
+ *   /sys/kernel/debug/petmem/stats           module-wide
+ *   /sys/kernel/debug/petmem/procs/<pid>-<n> one per open of /dev/petmem
+ */
+
+#ifndef __PETMEM_STATS_H__
+#define __PETMEM_STATS_H__
+
+#include <linux/types.h>
+#include <linux/percpu.h>
+#include <linux/log2.h>
+#include <asm/msr.h>
+
+#include "petmem.h"
+
+enum petmem_event {
+    PETMEM_FAULT_COMPULSORY, /* first touch, including fault-around's first page and large pages */
+    PETMEM_FAULT_MAJOR,      /* page read back from swap */
+    PETMEM_EVICT_CLOCK,
+    PETMEM_EVICT_FIFO,
+    PETMEM_SWAP_READ,
+    PETMEM_SWAP_WRITE,
+    PETMEM_PREFETCH_HIT,
+    PETMEM_NR_EVENTS
+};
+
+enum petmem_latency {
+    PETMEM_LAT_FAULT,   /* all of petmem_handle_pagefault() */
+    PETMEM_LAT_SWAP_IO, /* one page read or written */
+    PETMEM_NR_LATENCIES
+};
+
+/* Bucket i counts durations of [2^i, 2^(i+1)) ns, the last one everything longer */
+#define PETMEM_LAT_BUCKETS 32
+
+struct petmem_stats {
+    u64 events[PETMEM_NR_EVENTS];
+    u64 latency[PETMEM_NR_LATENCIES][PETMEM_LAT_BUCKETS];
+    u64 phase_cycles[NR_PHASES]; /* per process only, see PHASE_STATS */
+    u64 phase_calls[NR_PHASES];
+};
+
+DECLARE_PER_CPU(struct petmem_stats, petmem_global_stats);
+
+struct dentry;
+
+
+static inline void petmem_count(struct petmem_stats __percpu * stats, enum petmem_event ev) {
+    this_cpu_inc(stats->events[ev]);
+    this_cpu_inc(petmem_global_stats.events[ev]);
+}
+
+static inline void petmem_record_latency(struct petmem_stats __percpu * stats, enum petmem_latency lat, u64 ns) {
+    int bucket = (ns > 1) ? ilog2(ns) : 0;
+
+    if (bucket >= PETMEM_LAT_BUCKETS) {
+	bucket = PETMEM_LAT_BUCKETS - 1;
+    }
+    this_cpu_inc(stats->latency[lat][bucket]);
+    this_cpu_inc(petmem_global_stats.latency[lat][bucket]);
+}
+
+
+/* TSC phase timing: start = rdtsc_ordered(); ...; petmem_phase_end(stats, phase, start) */
+static inline void petmem_phase_add(struct petmem_stats __percpu * stats, int phase, u64 cycles) {
+    this_cpu_add(stats->phase_cycles[phase], cycles);
+    this_cpu_inc(stats->phase_calls[phase]);
+}
+
+static inline void petmem_phase_end(struct petmem_stats __percpu * stats, int phase, u64 start) {
+    petmem_phase_add(stats, phase, rdtsc_ordered() - start);
+}
+
+
+int petmem_stats_init(void);
+void petmem_stats_exit(void);
+
+/* Per process sets. The debugfs file has to be removed before the set is freed. */
+struct petmem_stats __percpu * petmem_stats_alloc(void);
+void petmem_stats_free(struct petmem_stats __percpu * stats);
+struct dentry * petmem_stats_add_process(struct petmem_stats __percpu * stats, pid_t pid);
+void petmem_stats_remove_process(struct dentry * file);
+void petmem_stats_dump(struct petmem_stats __percpu * stats);
+void petmem_stats_phases(struct petmem_stats __percpu * stats, struct phase_stats * phases);
+
+#endif
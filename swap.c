@@ -4,39 +4,57 @@
 
 #include <linux/slab.h>
 #include <linux/string.h>
+#include <linux/mutex.h>
 
+#include "petmem.h"
 #include "file_io.h"
 #include "swap.h"
+#include "petmem_trace.h"
 #define POWER_4KB 12
 #define BITS_IN_A_BYTE 3 // 1 byte = 2^3 bits?
 
+/* There is one swap file, so every process shares one swap area and its bitmap. */
+static struct swap_space * petmem_swap = NULL;
+static DEFINE_MUTEX(petmem_swap_mutex); // guards petmem_swap and its reference count
+
 /* this function doesn't need a parameter; 
  * the swap size is specified when we 
  * manually create /tmp/cs452.swap 
  * the command we use: dd if=/dev/zero of=/tmp/cs452.swap bs=4096 count=256 */
 struct swap_space * swap_init(void) {
     u32 pages, char_map_page_size;
-    struct swap_space * swap = kmalloc(sizeof(struct swap_space), GFP_KERNEL);
-	printk(KERN_INFO "initializing the swap space\n");
+    struct swap_space * swap;
+
+    mutex_lock(&petmem_swap_mutex);
+    if (petmem_swap) {
+        petmem_swap->refs++;
+        mutex_unlock(&petmem_swap_mutex);
+        return petmem_swap;
+    }
+
+    swap = kmalloc(sizeof(struct swap_space), GFP_KERNEL);
+	petmem_dbg("initializing the swap space\n");
     swap->swap_file = file_open("/tmp/cs452.swap", O_RDWR);
     if(!(swap->swap_file)){
         //BIG PROBLEM!
+        kfree(swap);
+        mutex_unlock(&petmem_swap_mutex);
         return (struct swap_space * ) 0x0;
     }
     swap->size = file_size(swap->swap_file);
     pages = swap->size >> POWER_4KB; // 4kb per page
     swap->size = pages; // if we have 256 pages in total, then swap->size is 256.
 	/* let's say we have 256 pages, then we need 256>>3, 
-	 * which is 2^8>>3=2^5, and then 2^5+1=33, 
-	 * so we first read 33 bytes into a memory buffer pointed by swap->alloc_map,
-	 * and 33 bytes is 264 bits. */
-    char_map_page_size = pages >> BITS_IN_A_BYTE;
-    if(char_map_page_size % BITS_IN_A_BYTE != 0){
-        char_map_page_size += 1;
-    }
-	/* read the swap file, and read its content into swap->alloc_map. */
-    swap->alloc_map = kmalloc(char_map_page_size, GFP_KERNEL);
-    file_read(swap->swap_file, (swap->alloc_map), char_map_page_size, 0);
+	 * which is 2^8>>3=2^5=32 bytes for swap->alloc_map,
+	 * rounded up when the page count is not a multiple of 8. */
+    char_map_page_size = (pages + 7) >> BITS_IN_A_BYTE;
+	/* Nobody holds a slot when the area is first set up, so every slot starts free. */
+    swap->alloc_map = kzalloc(char_map_page_size, GFP_KERNEL);
+    spin_lock_init(&(swap->lock));
+    swap->refs = 1;
+
+    petmem_swap = swap;
+    mutex_unlock(&petmem_swap_mutex);
 
     return swap;
 }
@@ -75,35 +93,66 @@ void put_value(struct swap_space * swap, u32 index, u8 value){
 
 
 void swap_free(struct swap_space * swap) {
-	printk(KERN_INFO "free the swap space\n");
+    mutex_lock(&petmem_swap_mutex);
+    if (--swap->refs > 0) {
+        mutex_unlock(&petmem_swap_mutex);
+        return;
+    }
+	petmem_dbg("free the swap space\n");
     file_close(swap->swap_file);
     kfree(swap->alloc_map);
     kfree(swap);
+    petmem_swap = NULL;
+    mutex_unlock(&petmem_swap_mutex);
 }
 
 
-int swap_out_page(struct swap_space * swap, u32 * index, void * page) {
+/* Reserves a free slot. Returns 0 on success, -1 if the swap area is full. */
+int swap_alloc_slot(struct swap_space * swap, u32 * index) {
 	int i;
+	spin_lock(&(swap->lock));
 	for(i = 0; i < swap->size; i++){
 		/* as soon as we find one bit which is 0, then we set it to 1 and use it. */
 		if(check_bitmap(swap, i) == 0){
 			put_value(swap, i, 1);
-			/* and we record this page is written into page i of the swap space. */
 			*index = i;
-			/* swap out to disk. write page into swap space. */
-			file_write(swap->swap_file, page, 4096, i * 4096);
-			printk("FOUND DAT FILE AT %d\n", i);
-			break;
+			spin_unlock(&(swap->lock));
+			return 0;
 		}
 	}
+	spin_unlock(&(swap->lock));
 	return -1;
 }
 
+void free_block(struct swap_space * swap, u32 index) {
+	spin_lock(&(swap->lock));
+	put_value(swap, index, 0);
+	spin_unlock(&(swap->lock));
+}
+
+
 int swap_in_page(struct swap_space * swap, u32 index, void * dst_page) {
-    printk("Index is: %d", index);
+    petmem_dbg("Swapping in slot %u\n", index);
+    swap_read_page(swap, index, dst_page);
+    free_block(swap, index); //Free up space in the swap bitmap
+    return 0;
+}
+
+/* Reads a slot without releasing it, so a clean page can later be dropped without a write. */
+int swap_read_page(struct swap_space * swap, u32 index, void * dst_page) {
 	/* swap into memory, read the page into dst_page. */
-    file_read(swap->swap_file, dst_page, 4096, index * 4096);
-    put_value(swap, index, 0); //Free up space in the swap bitmap
+    if (file_read(swap->swap_file, dst_page, 4096, index * 4096) != 4096) {
+	return -1;
+    }
+    return 0;
+}
+
+/* Overwrites a slot that is already allocated to the page. */
+int swap_write_page(struct swap_space * swap, u32 index, void * page) {
+    trace_petmem_swap_out(index);
+    if (file_write(swap->swap_file, page, 4096, index * 4096) != 4096) {
+	return -1;
+    }
     return 0;
 }
 
@@ -3,6 +3,7 @@
  */
 
 #include <linux/fs.h>
+#include <linux/spinlock.h>
 
 #ifndef __SWAP_H__
 #define __SWAP_H__
@@ -13,6 +14,8 @@ struct swap_space {
     unsigned long long size;
     u32 reserved_blocks;
     /* add your own fields here */
+    spinlock_t lock; /* protects alloc_map; never held across file I/O */
+    int refs;        /* processes sharing this swap area */
 };
 
 struct swap_space * swap_init(void);
@@ -20,9 +23,11 @@ void swap_deinit(struct swap_space * swap);
 void swap_free(struct swap_space * swap);
 
 int check_bitmap(struct swap_space * swap, u32 index);
+int swap_alloc_slot(struct swap_space * swap, u32 * index);
 void free_block(struct swap_space * swap, u32 index);
 
-int swap_out_page(struct swap_space * swap, u32 * index, void * page);
 int swap_in_page(struct swap_space * swap, u32 index, void * dst_page);
+int swap_read_page(struct swap_space * swap, u32 index, void * dst_page);
+int swap_write_page(struct swap_space * swap, u32 index, void * page);
 
 #endif
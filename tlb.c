@@ -0,0 +1,86 @@
+/* Batched TLB invalidation
+ */
+
+#include <linux/module.h>
+#include <linux/version.h>
+#include <linux/smp.h>
+#include <linux/cpumask.h>
+#include <linux/mm_types.h>
+#include <asm/tlbflush.h>
+
+#include "petmem.h"
+#include "tlb.h"
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4,16,0)
+#define __flush_tlb_one_user(addr) __flush_tlb_single(addr)
+#endif
+
+
+void tlb_batch_init(struct tlb_batch * batch, struct mm_struct * mm) {
+    batch->mm = mm;
+    batch->nr = 0;
+    batch->full = 0;
+}
+
+void tlb_batch_add(struct tlb_batch * batch, uintptr_t vaddr) {
+    if (batch->full) {
+	return;
+    }
+
+    if (batch->nr == TLB_BATCH_MAX) {
+	batch->full = 1;
+	return;
+    }
+
+    batch->addrs[batch->nr++] = vaddr;
+}
+
+/* A page table page was unlinked, so cached paging-structure entries must go too */
+void tlb_batch_add_table(struct tlb_batch * batch) {
+    batch->full = 1;
+}
+
+
+/* Runs on every CPU in the mm's cpumask, in IPI context for the remote ones. The
+ * kernel's own helpers are used, with PTI they also drop the user PCID's entries,
+ * which an invlpg or CR3 reload from kernel mode leaves behind. */
+static void tlb_batch_flush_local(void * info) {
+    struct tlb_batch * batch = info;
+    unsigned int i;
+
+    /* The CPU has switched to another mm since, the new generation catches it on switch back */
+    if ((batch->mm) && (this_cpu_read(cpu_tlbstate.loaded_mm) != batch->mm)) {
+	return;
+    }
+
+    if (batch->full) {
+	__flush_tlb();
+	return;
+    }
+
+    for (i = 0; i < batch->nr; i++) {
+	__flush_tlb_one_user(batch->addrs[i]);
+    }
+}
+
+/* Sends IPIs and waits for them, so must not be called with a spinlock held */
+void tlb_batch_flush(struct tlb_batch * batch) {
+    if ((batch->nr == 0) && (!batch->full)) {
+	return;
+    }
+
+    if (batch->mm) {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4,13,0)
+	/* With PCID a CPU keeps the mm's entries after switching away and drops out of
+	 * mm_cpumask, it flushes them when it switches back and sees a newer generation */
+	inc_mm_tlb_gen(batch->mm);
+#endif
+	/* Every CPU that has the address space loaded */
+	on_each_cpu_mask(mm_cpumask(batch->mm), tlb_batch_flush_local, batch, 1);
+    } else {
+	tlb_batch_flush_local(batch);
+    }
+
+    batch->nr = 0;
+    batch->full = 0;
+}
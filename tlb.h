@@ -0,0 +1,28 @@
+/* Batched TLB invalidation
+ * Collects the user addresses whose mappings changed and flushes them on every
+ * CPU that may be caching this address space, with one IPI round.
+ */
+
+#ifndef __TLB_H__
+#define __TLB_H__
+
+#include <linux/types.h>
+
+/* Past this many pages one full flush is cheaper than invalidating page by page */
+#define TLB_BATCH_MAX 32
+
+struct mm_struct;
+
+struct tlb_batch {
+    struct mm_struct * mm;
+    unsigned int nr;
+    int full;         /* flush the whole address space, set on overflow or when a table page was freed */
+    uintptr_t addrs[TLB_BATCH_MAX];
+};
+
+void tlb_batch_init(struct tlb_batch * batch, struct mm_struct * mm);
+void tlb_batch_add(struct tlb_batch * batch, uintptr_t vaddr);
+void tlb_batch_add_table(struct tlb_batch * batch);
+void tlb_batch_flush(struct tlb_batch * batch);
+
+#endif
@@ -0,0 +1,42 @@
+/*
+ * Runs the allocator microbenchmark in the module and prints cycles per operation
+ * usage: buddy_bench
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+
+#include "../petmem.h"
+
+
+int main(int argc, char * argv[]) {
+    struct buddy_bench bench;
+    int fd = 0;
+
+    fd = open(dev_file, O_RDONLY);
+
+    if (fd == -1) {
+	printf("Error opening petmem control device\n");
+	return -1;
+    }
+
+    if (ioctl(fd, BUDDY_BENCH, &bench) != 0) {
+	printf("Error running the allocator benchmark\n");
+	close(fd);
+	return -1;
+    }
+
+    printf("%llu alloc/free pairs of single pages\n", bench.pairs);
+    printf("alloc: %llu cycles\n", bench.alloc_cycles);
+    printf("free:  %llu cycles\n", bench.free_cycles);
+    printf("pair:  %llu cycles\n", bench.alloc_cycles + bench.free_cycles);
+
+    close(fd);
+
+    return 0;
+}
@@ -39,6 +39,32 @@ void pet_dump() {
     return;
 }
 
+/* Where the fault time of this process went, see PHASE_STATS */
+void pet_dump_phases() {
+    static const char * names[NR_PHASES] = {
+	"region lookup", "table walk", "frame alloc", "victim select", "swap out", "swap in",
+	"background io"
+    };
+    struct phase_stats stats;
+    int i = 0;
+
+    if (ioctl(fd, PHASE_STATS, &stats) != 0) {
+	return;
+    }
+
+    printf("phase           calls       total us    avg ns\n");
+    for (i = 0; i < NR_PHASES; i++) {
+	if ((stats.calls[i] == 0) || (stats.tsc_khz == 0)) {
+	    continue;
+	}
+	printf("%-14s  %-10llu  %-10llu  %llu\n", names[i], stats.calls[i],
+	       stats.cycles[i] * 1000 / stats.tsc_khz,
+	       stats.cycles[i] / stats.calls[i] * 1000000 / stats.tsc_khz);
+    }
+
+    return;
+}
+
 void pet_invlpg(void * addr) {
     ioctl(fd, INVALIDATE_PAGE, addr);
     return;
@@ -5,4 +5,5 @@ int init_petmem(void);
 void * pet_malloc(size_t size);
 void pet_free(void * addr);
 void pet_dump();
+void pet_dump_phases();
 void pet_invlpg(void * addr);
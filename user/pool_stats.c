@@ -0,0 +1,66 @@
+/*
+ * Prints the state of every petmem memory pool and NUMA node
+ * usage: pool_stats [-c]   (-c runs a compaction pass first)
+ */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+#include <string.h>
+
+
+#include "../petmem.h"
+
+
+int main(int argc, char * argv[]) {
+    struct pool_stats stats;
+    struct node_stats nstats;
+    struct vspace_stats vstats;
+    int fd = 0;
+
+    fd = open(dev_file, O_RDONLY);
+
+    if (fd == -1) {
+	printf("Error opening petmem control device\n");
+	return -1;
+    }
+
+    if ((argc == 2) && (strcmp(argv[1], "-c") == 0)) {
+	ioctl(fd, COMPACT_MEMORY, 0);
+    }
+
+    printf("pool  node  base                pages       free        frag\n");
+
+    /* Pool ids are handed out in order, the first one that fails is past the end */
+    for (stats.pool_id = 0; ; stats.pool_id++) {
+	if (ioctl(fd, POOL_STATS, &stats) != 0) {
+	    break;
+	}
+
+	printf("%4u  %4u  0x%016llx  %-10llu  %-10llu  %u/1000\n",
+	       stats.pool_id, stats.node, stats.base_addr, stats.pages, stats.free_pages, stats.frag_index);
+    }
+
+    printf("\nnode  pages       free        local allocs  remote allocs\n");
+
+    /* Same for node ids */
+    for (nstats.node = 0; ; nstats.node++) {
+	if (ioctl(fd, NODE_STATS, &nstats) != 0) {
+	    break;
+	}
+
+	printf("%4u  %-10llu  %-10llu  %-12llu  %llu\n",
+	       nstats.node, nstats.pages, nstats.free_pages, nstats.local_allocs, nstats.remote_allocs);
+    }
+
+    if (ioctl(fd, VSPACE_STATS, &vstats) == 0) {
+	printf("\npage table pages, all processes: %llu\n", vstats.table_pages_total);
+    }
+
+    close(fd);
+
+    return 0;
+}
@@ -0,0 +1,84 @@
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <string.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sys/time.h>
+
+#include "harness.h"
+
+#define PAGE_SIZE 4096
+
+double Time_GetSeconds() {
+    struct timeval t;
+    int rc = gettimeofday(&t, NULL);
+    assert(rc == 0);
+    return (double) ((double)t.tv_sec + (double)t.tv_usec / 1e6);
+}
+
+struct worker {
+    pthread_t thread;
+    char * buf;
+    long long int pages;
+};
+
+/* Every first touch is a compulsory fault, so this measures fault (and frame allocation) throughput */
+static void * touch_pages(void * arg) {
+    struct worker * w = arg;
+    long long int i;
+
+    for (i = 0; i < w->pages; i++) {
+        w->buf[i * PAGE_SIZE] = 1;
+    }
+    return NULL;
+}
+
+/* Multi-threaded fault benchmark.
+ * Each thread touches its own region once; run with 1, 2, 4... threads to see how it scales.
+ */
+int main(int argc, char ** argv) {
+    if (argc != 3) {
+        fprintf(stderr, "usage: test_mt_fault <threads> <memory per thread (MB)>\n");
+        exit(1);
+    }
+    int num_threads = atoi(argv[1]);
+    long long int size_in_bytes = (long long int)atoi(argv[2]) * 1024 * 1024;
+    struct worker * workers = calloc(num_threads, sizeof(struct worker));
+    int i;
+
+    /* this will setup the signal handler to take care of seg fault */
+    init_petmem();
+
+    for (i = 0; i < num_threads; i++) {
+        workers[i].buf = pet_malloc(size_in_bytes);
+        workers[i].pages = size_in_bytes / PAGE_SIZE;
+        if (workers[i].buf == NULL) {
+            fprintf(stderr, "memory allocation failed\n");
+            exit(1);
+        }
+    }
+
+    double t = Time_GetSeconds();
+    for (i = 0; i < num_threads; i++) {
+        pthread_create(&workers[i].thread, NULL, touch_pages, &workers[i]);
+    }
+    for (i = 0; i < num_threads; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    double delta_time = Time_GetSeconds() - t;
+
+    long long int faults = workers[0].pages * num_threads;
+    printf("%d threads: %lld faults in %.2f ms (%.0f faults/s)\n",
+           num_threads, faults, 1000 * delta_time, faults / delta_time);
+    pet_dump_phases();
+
+    for (i = 0; i < num_threads; i++) {
+        pet_free(workers[i].buf);
+    }
+    free(workers);
+
+    return 0;
+}
+
+/* vim: set ts=4: */